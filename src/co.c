@@ -1,43 +1,157 @@
+#define _GNU_SOURCE // accept4
 #include "co.h"
 #include "list.h"
 #include "lang_items.h"
 
 #include <stdio.h>
-#include <setjmp.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <stdatomic.h>
-#include <semaphore.h>
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <link.h>
+#include <sys/auxv.h>
+#include <sched.h>
+#include <dirent.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
 
-static inline void
-stack_switch_call(void *sp, void *entry, uintptr_t arg) {
-    asm volatile (
+/** Context switch: push the callee-saved registers and the MXCSR / x87 control words on the current stack,
+  * save the stack pointer to *from, load the stack pointer from *to and pop the same frame there.
+  * The value passed in val is returned by the co_context_switch call that is resumed.
+  * It returns with an indirect jump instead of ret, which would always miss the return stack buffer.
+  */
+__asm__(
+        ".text\n"
+        ".globl co_context_switch\n"
+        ".hidden co_context_switch\n"
+        ".type co_context_switch, @function\n"
+        "co_context_switch:\n"
 #if __x86_64__
-            "movq %0, %%rsp; movq %2, %%rdi; jmp *%1"
-            :
-            : "b"((uintptr_t) sp - 8),
-    "d"(entry),
-    "a"(arg)
-            : "memory"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    subq $8, %rsp\n"
+        "    stmxcsr (%rsp)\n"
+        "    fnstcw 4(%rsp)\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq (%rsi), %rsp\n"
+        "    ldmxcsr (%rsp)\n"
+        "    fldcw 4(%rsp)\n"
+        "    addq $8, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    movq %rdx, %rax\n"
+        "    popq %r8\n"
+        "    jmp *%r8\n"
 #else
-        "movl %0, %%esp; movl %2, 4(%0); jmp *%1"
-          :
-          : "b"((uintptr_t)sp - 8),
-            "d"(entry),
-            "a"(arg)
-          : "memory"
+        "    movl 4(%esp), %eax\n"
+        "    movl 8(%esp), %edx\n"
+        "    movl 12(%esp), %ecx\n"
+        "    pushl %ebp\n"
+        "    pushl %ebx\n"
+        "    pushl %esi\n"
+        "    pushl %edi\n"
+        "    subl $8, %esp\n"
+        "    stmxcsr (%esp)\n"
+        "    fnstcw 4(%esp)\n"
+        "    movl %esp, (%eax)\n"
+        "    movl (%edx), %esp\n"
+        "    ldmxcsr (%esp)\n"
+        "    fldcw 4(%esp)\n"
+        "    addl $8, %esp\n"
+        "    popl %edi\n"
+        "    popl %esi\n"
+        "    popl %ebx\n"
+        "    popl %ebp\n"
+        "    movl %ecx, %eax\n"
+        "    popl %edx\n"
+        "    jmp *%edx\n"
 #endif
-            );
-}
+        ".size co_context_switch, .-co_context_switch\n"
+        // first frame of a new coroutine: call entry(arg), both prepared by co_context_make
+        ".globl co_context_entry\n"
+        ".hidden co_context_entry\n"
+        ".type co_context_entry, @function\n"
+        "co_context_entry:\n"
+#if __x86_64__
+        "    movq %rbx, %rdi\n"
+        "    callq *%r12\n"
+#else
+        "    pushl %ebx\n"
+        "    calll *%esi\n"
+#endif
+        "    ud2\n"
+        ".size co_context_entry, .-co_context_entry\n"
+);
 
 /* config */
-#define CO_STACK_SIZE (1024 * 16) // 16KB
+#define CO_STACK_SIZE (1024 * 16) // 16KB, default
+#define CO_SHARED_STACK_SIZE (1024 * 1024) // 1MB, default, committed lazily
 #define CO_RUNTIME_STACK_SIZE (1024 * 4) // 4KB
-#define RUN_QUEUE_SIZE 256
-#define M_NUM 24
+#define CO_MAIN_G0_STACK_SIZE (1024 * 256) // the scheduler of main's M, other Ms schedule on their thread stacks
+#define RUN_QUEUE_SIZE 256 // default, rounded up to a power of 2 when configured
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#define TOPO_LEVELS 4 // victims on the same core, the same last-level cache, the same node, then remote nodes
+#define CO_MXCSR_DEFAULT 0x1f80
+#define CO_FPUCW_DEFAULT 0x037f
+#define STEAL_ROUNDS 4 // rounds a spinning M tries to steal before parking
+#define GLOBAL_QUEUE_TICK 61 // poll global queue every GLOBAL_QUEUE_TICK schedules to avoid starving it
+#define PRIORITY_CLASSES 3 // see enum co_priority
+#define CRITICAL_WEIGHT 4 // picks of latency-critical coroutines for every normal one while both are queued
+#define BACKGROUND_TICK 64 // a queued background coroutine runs at least once every BACKGROUND_TICK schedules
+#define CO_NAME_INLINE 32 // names shorter than this are stored in struct co itself
+#define P_CACHE_SIZE 64 // free objects a P keeps before handing half of them to the global depot
+#define DEPOT_SIZE 1024 // free objects the global depot keeps before releasing the rest
+#define NETPOLL_EVENTS 128 // events taken by one epoll_wait
+#define POLL_DESC_CHUNK 1024 // poll descriptors are allocated for this many fds at a time
+#define POLL_DESC_MAX_FDS (1 << 20) // fds covered when RLIMIT_NOFILE is unlimited
+#define PD_READY ((uintptr_t) 1) // the fd became ready and nobody has consumed it yet
+#define PD_WAIT ((uintptr_t) 2) // a coroutine is about to park on the fd
+#define NETPOLL_URING ((uintptr_t) 1) // tags the epoll data of a ring's eventfd, poll_desc pointers are aligned
+#define URING_ENTRIES 256 // submission queue size of each M's io_uring
+#define IO_POOL_THREADS 4 // threads serving file I/O when io_uring is not used
+#define TIMER_TICK_NS 1000000 // 1ms, the resolution of the timing wheels
+#define TIMER_LEVELS 4 // a wheel spans 64^4 ticks (~4.6 hours), later timers are re-cascaded
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_NONE UINT64_MAX // next deadline of a wheel without timers
+#define LOCK_SPIN_ROUNDS 4 // times a contended lock spins before parking
+#define LOCK_SPIN_PAUSES 30 // pause instructions per spin round
+#define SEM_WAITERS 1u // coroutines may be parked on the semaphore, posting takes the slow path
+#define SEM_COUNT 2u // the count is kept above the flag
+#define MUTEX_LOCKED 1u
+#define MUTEX_WAITERS 2u // coroutines may be parked on the mutex, unlocking takes the slow path
+#define RW_WRITER 1u
+#define RW_WAITERS 2u // coroutines may be parked on the rwlock, the last one to release takes the slow path
+#define RW_READER 4u // the reader count is kept above the two flags
+#define CO_TIME_SLICE (10 * 1000000ULL) // 10ms, default, a preemptible coroutine running longer is switched out
+#define PREEMPT_SIGNAL SIGURG // ignored by default, so no other code is likely to expect it
+#define CHAN_SELECT_LOCAL 4 // cases of a parking co_select whose waiters live on the stack, more are allocated
 
 /* Coroutine */
 enum co_status {
@@ -52,15 +166,67 @@ enum co_trap_id {
     CO_YIELD,
     CO_EXIT,
     CO_WAIT,
-    CO_SEM_WAIT,
+    CO_PARK,
+    CO_NET_WAIT,
+    CO_IO_WAIT,
+    CO_SLEEP,
+    CO_CHAN_WAIT,
+};
+
+enum co_io_op {
+    CO_IO_READ,
+    CO_IO_WRITE,
+    CO_IO_FSYNC,
+};
+
+// the file operation a coroutine waits for, kept in struct co since shared stacks move while suspended
+struct co_io {
+    enum co_io_op op;
+    int fd;
+    void *buf;
+    size_t count;
+    off_t offset;
+    ssize_t res; // as returned by the kernel, -errno on failure
+    uint node; // NUMA node of the P it was issued on, the thread pool hands the coroutine back there
 };
 
-typedef jmp_buf co_context;
+typedef struct {
+    void *sp;
+} co_context;
 
-struct loop_queue {
-    struct g *inner[RUN_QUEUE_SIZE];
-    uint head;
-    uint tail;
+__attribute__((visibility("hidden")))
+extern uintptr_t co_context_switch(co_context *from, co_context *to, uintptr_t val);
+__attribute__((visibility("hidden")))
+extern void co_context_entry();
+
+/* Timer */
+struct timer {
+    struct node link; // in a slot of a wheel, or in the expired list while firing
+    uint64_t when; // deadline in ns of CLOCK_MONOTONIC
+    uint64_t expire; // tick of the slot it sits in
+    int level, slot; // the slot it sits in
+    struct p *_Atomic p; // whose wheel it is on, NULL once fired or deleted
+    atomic_int firing; // set when it expires, func clears it with timer_fired before its owner may go on
+    void (*func)(struct timer *timer, struct p *p_current); // runs on the M that fires it, outside the wheel lock
+};
+
+// hierarchical timing wheel, level l holds the timers expiring within 64^(l+1) ticks
+struct timer_wheel {
+    pthread_mutex_t mutex; // the P's own M adds and fires, other Ms fire expired timers of parked Ps
+    uint64_t tick; // every timer expiring at or before this tick has fired
+    struct list slots[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t occupied[TIMER_LEVELS]; // bit s set when slots[l][s] is not empty
+    uint count;
+    _Atomic uint64_t next_when; // no timer fires before this (ns), TIMER_NONE if there are none
+};
+
+/* Lock-free work-stealing queue: only the owner P pushes at tail, owner and thieves take from head */
+struct run_queue {
+    atomic_uint head;
+    atomic_uint tail;
+    uint mask; // capacity - 1
+    _Atomic(struct g *) *inner;
+    uint node; // NUMA node of the owning P, overflow goes to the injection queue of that node
 };
 
 struct mutex_queue {
@@ -68,43 +234,238 @@ struct mutex_queue {
     struct list queue;
 };
 
+/* Cache of free objects linked through their first word */
+struct free_cache {
+    void *head;
+    uint size;
+};
+
+/* Global overflow of the per-P caches */
+struct depot {
+    pthread_mutex_t mutex;
+    struct free_cache cache;
+};
+
 struct co {
     struct g *g;
     char *name;
+    char name_inline[CO_NAME_INLINE];
     void (*func)(void *);
+    union co_value (*value_func)(void *); // set instead of func by co_spawn
+    union co_value result; // returned by value_func, read by waiters once they see CO_DEAD
     void *arg;
     pthread_mutex_t status_mutex;
     enum co_status status;
+    struct co_io io;
+    atomic_int refs; // the user's handle plus the runtime's own until the coroutine exits
     struct list waiters;
+    struct list exit_nodes; // co_wait_all groups to count down when it exits
     co_context context;
-    uint8_t *stack;
+    uint8_t *stack; // lowest usable address, a guard page lies right below
+    size_t stack_size;
+    int shared; // runs on the shared stack of its M
+    int preemptible; // may be switched out by PREEMPT_SIGNAL once its time slice is used up
+    uint8_t *save_buf; // used part of the shared stack while suspended
+    size_t save_size;
+    size_t save_cap;
 };
 
 /* G-M-P model */
 struct g {
     struct m *m;
     struct co *co;
+    struct p *pinned; // a shared-stack coroutine only runs on the P (and M) that first ran it
+    enum co_priority priority; // the running queue it goes to
+    struct node link; // in a waiters list, a pinned queue or the global queue, at most one at a time
+    struct timer timer; // for co_sleep and timed waits
+    struct list *wait_list; // the waiters list g is linked in, set to NULL by whoever takes it off
+    pthread_mutex_t *wait_lock; // guards wait_list
+    int wait_timed; // g->timer may take g off wait_list, see timeout_wake
+    int wait_result; // 0, or -1 if the timer took g off wait_list
+};
+
+// a g and its co are allocated as one block
+struct g_block {
+    struct g g;
+    struct co co;
 };
 
 struct m {
     struct g *g0;
     struct p *p;
     pthread_t thread_id;
+    uint rand_state;
+    int spinning;
+    atomic_uint park_word; // futex word, set to 1 to unpark
+    struct m *idle_next;
+    uint8_t *shared_stack; // mapped on first use
+    struct co *shared_owner; // whose frames are on the shared stack now
+    struct uring *uring; // set up on first file I/O
+    int cpu; // the CPU the thread is pinned to, -1 if it is not
+    _Atomic uint64_t slice_start; // when the running preemptible coroutine got the M, 0 otherwise
 };
 
 struct p {
     struct co *to_be_waited;
-    struct co_sem *blocked_sem;
-    struct loop_queue all_queue;
-    struct loop_queue running_queue;
-    struct loop_queue dead_queue;
+    pthread_mutex_t *blocked_lock; // released once the current coroutine is parked, see g_park
+    struct chan_select *blocked_select; // the co_select the current coroutine parks in, its channels still locked
+    atomic_uintptr_t *blocked_poll; // rg or wg of the poll_desc the current coroutine parks on
+    struct uring *blocked_io; // the ring the current coroutine's file I/O is staged on, NULL for the thread pool
+    uint schedtick;
+    struct free_cache stack_cache; // only touched by the M owning this P
+    struct free_cache g_cache; // free g_blocks, only touched by the M owning this P
+    struct run_queue running_queues[PRIORITY_CLASSES]; // indexed by enum co_priority
+    struct mutex_queue pinned_queue; // runnable coroutines pinned to this P, other Ps may not steal them
+    atomic_uint pinned_size;
+    struct timer_wheel timers;
+    uint *steal_order; // the other Ps, nearest first
+    uint steal_end[TOPO_LEVELS]; // steal_order up to steal_end[level] is at most that far away
+};
+
+/* Netpoller */
+// readiness of an fd registered edge-triggered with epoll,
+// rg (reading) and wg (writing) each hold 0, PD_READY, PD_WAIT or the waiting g
+struct poll_desc {
+    int fd;
+    atomic_uintptr_t rg;
+    atomic_uintptr_t wg;
+    atomic_uint seq; // bumped by co_close, a coroutine waiting since an older seq fails
+    atomic_int registered; // 1 registered with epoll, -1 cannot be polled (e.g. regular files), 0 unknown
+    pthread_mutex_t mutex; // serializes registering and closing
+};
+
+// an io_uring of one M, only that M submits while any M may reap the completions
+struct uring {
+    int fd;
+    int event_fd; // registered with the ring and netpoll_fd, signalled on every completion
+    void *ring; // submission and completion rings in one mapping
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    atomic_uint *sq_head;
+    atomic_uint *sq_tail;
+    uint *sq_array;
+    uint sq_mask;
+    uint sq_entries;
+    uint to_submit; // staged but not yet entered
+    atomic_uint *cq_head;
+    atomic_uint *cq_tail;
+    uint cq_mask;
+    struct io_uring_cqe *cqes;
+    pthread_mutex_t cq_mutex;
+    atomic_uint inflight;
 };
 
 /* Semaphore */
 struct co_sem {
-    uint count;
+    atomic_uint state; // count * SEM_COUNT | SEM_WAITERS, wait and post only lock it for parked coroutines
+    struct list waiters;
+    pthread_mutex_t mutex; // guards waiters
+};
+
+/* Locks, uncontended acquire and release are a single CAS on state, wait_mutex only guards the parked coroutines */
+struct co_mutex {
+    atomic_uint state; // MUTEX_LOCKED | MUTEX_WAITERS
+    pthread_mutex_t wait_mutex;
+    struct list waiters;
+};
+
+struct co_rwlock {
+    atomic_uint state; // readers * RW_READER | RW_WRITER | RW_WAITERS
+    pthread_mutex_t wait_mutex;
+    struct list readers;
+    struct list writers;
+};
+
+struct co_cond {
+    atomic_uint waiting; // parked coroutines, signals skip the lock without them
+    pthread_mutex_t wait_mutex;
+    struct list waiters;
+};
+
+// counter (high 32 bits) and parked waiters (low 32 bits) in one word, like Go's sync.WaitGroup
+struct co_waitgroup {
+    _Atomic uint64_t state;
+    pthread_mutex_t wait_mutex; // serializes parking against the wake-up once the counter drops to zero
     struct list waiters;
+};
+
+// links the group of a co_wait_all into co->exit_nodes of one of its targets
+struct exit_node {
+    struct node link;
+    struct co_waitgroup *wg;
+};
+
+/* Channel */
+struct co_chan {
     pthread_mutex_t mutex;
+    size_t elem_size;
+    uint capacity;
+    uint head; // slot of the oldest buffered element
+    uint count; // buffered elements
+    uint8_t *buf; // capacity slots of elem_size bytes
+    int closed;
+    struct list recvq; // chan_waiters of parked receivers
+    struct list sendq; // chan_waiters of parked senders
+};
+
+// a parked co_select, the first waker to claim done completes one of its cases
+struct chan_select {
+    atomic_int done;
+    int index; // the completed case
+    int ok;
+    struct co_chan **order; // its channels in lock order
+    int nchan;
+};
+
+// one case of a parked co_select, linked in the recvq or sendq of its channel
+struct chan_waiter {
+    struct node link;
+    struct g *g;
+    struct chan_select *select;
+    void *elem; // the element of the case, or a copy of it when the coroutine runs on a shared stack
+    int index;
+};
+
+// one co_parallel_for or co_parallel_reduce call, shared by all of its tasks
+struct parallel_job {
+    long grain;
+    void (*for_body)(long begin, long end, void *ctx);
+    void (*reduce_body)(long begin, long end, void *acc, void *ctx);
+    void (*combine)(void *acc, const void *other, void *ctx);
+    size_t size; // of a partial result
+    void *ctx;
+    max_align_t identity[]; // copied, the caller's may live on a shared stack
+};
+
+// a sub-range run by one coroutine, which splits its upper half off whenever the halves split off before are taken
+struct parallel_task {
+    struct parallel_job *job;
+    long begin, end;
+    struct co *co;
+    struct parallel_task *children; // split off halves, the latest (lowest range) first
+    struct parallel_task *next;
+    void *acc; // partial result, NULL for co_parallel_for
+    max_align_t acc_inline[];
+};
+
+// where a CPU sits, each field is the lowest CPU sharing it
+struct cpu_topo {
+    int cpu;
+    int core;
+    int llc;
+    int node;
+};
+
+// what the current thread runs, both NULL on threads that are not Ms
+struct tls_block {
+    struct g *g; // the current coroutine, g0 of m while it schedules
+    struct m *m;
+};
+
+// executable code of a loaded object, a coroutine interrupted inside it is not preempted
+struct text_range {
+    uintptr_t start;
+    uintptr_t end;
 };
 
 /* Debug */
@@ -114,512 +475,3340 @@ void print_co_list(struct list *list) {
         panic("list has not been initialized");
         return;
     }
-    struct node *node = list->head->next;
-    while (node != list->tail) {
-        printf("%s ", ((struct co *) node->data)->name);
-        node = node->next;
+    for (struct node *node = list->head.next; node != &list->head; node = node->next) {
+        printf("%s ", list_entry(node, struct g, link)->co->name);
     }
     printf("\n");
 }
 
 /* Runtime support */
-static struct m m_set[M_NUM];
-static struct p p_set[M_NUM]; // loop_queue and m are one-to-one relationship
-static struct mutex_queue global_queue;
-static pthread_key_t tls_key_g_current;
+static struct m *m_set;
+static struct p *p_set; // p and m are one-to-one relationship
+static uint m_num; // m_set[0] belongs to main
+static size_t co_stack_size = CO_STACK_SIZE;
+static size_t page_size = 4096;
+static size_t shared_stack_size = CO_SHARED_STACK_SIZE;
+static uint run_queue_size = RUN_QUEUE_SIZE;
+static struct depot stack_depot;
+static struct depot g_depot;
+static struct mutex_queue *node_queues; // injection queues, one per NUMA node the Ms run on
+static uint node_num = 1;
+static atomic_uint global_queue_size = 0; // coroutines in all node_queues
+static int affinity_disabled = 0;
+static cpu_set_t process_cpus; // affinity at co_init, threads started later by a pinned M must not inherit its own
+// initial-exec, so that even inside the shared library the current coroutine is one %fs / %gs relative load
+static __thread struct tls_block tls_current __attribute__((tls_model("initial-exec")));
 static struct co *co_main = NULL;
-static sem_t co_main_sem;
 static int exit_signal = 0;
-static atomic_int co_num = 0;
+static atomic_int m_spinning_num = 0; // Ms looking for work, they need no wakeup
+static atomic_int m_idle_num = 0;
+static struct m *m_idle_list = NULL;
+static pthread_mutex_t m_idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int netpoll_fd = -1;
+static int netpoll_break_fd = -1; // an eventfd in netpoll_fd, written to interrupt a blocking netpoll
+static atomic_int netpoll_break_pending = 0;
+static atomic_int netpoll_waiters = 0; // coroutines parked on fds
+static atomic_int netpoll_blocked = 0; // some M is blocked in epoll_wait instead of parking
+static _Atomic(struct poll_desc *) *poll_desc_chunks;
+static uint poll_desc_chunk_num;
+static atomic_int uring_disabled = 0; // by configuration or because the kernel lacks io_uring
+static struct list io_pool_queue; // coroutines whose file I/O waits for a pool thread
+static pthread_mutex_t io_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t io_pool_threads[IO_POOL_THREADS];
+static int io_pool_started = 0;
+static _Atomic uint64_t netpoll_until = 0; // deadline the blocked netpoll M sleeps until
+static uint64_t time_slice = CO_TIME_SLICE;
+static pthread_mutex_t preempt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int preempt_started = 0;
+static pthread_t preempt_thread;
+static struct text_range preempt_unsafe[4]; // code of libco, libc, the dynamic loader and the vDSO
 /* ----------------------------- */
 
 static void g_destroy(struct g *g);
 static struct g *g_get_current();
 static struct m *m_get_current();
 static void *m_run_coroutine(void *ptr);
+static void m_main_g0(void *arg);
+static void m_schedule(struct g *g0, int val);
+static struct g *m_find_runnable(struct m *m_current, struct p *p_current);
+static void m_reset_spinning(struct m *m_current);
+static void m_park(struct m *m_current);
+static int m_idle_remove(struct m *m_current);
+static void m_wakeup();
+static void m_wakeup_many(size_t n);
+static void m_wakeup_pinned(struct m *m);
+static int work_available(struct p *p_current);
+static void futex_wait(atomic_uint *addr, uint val);
+static void futex_wake(atomic_uint *addr);
 static void p_init(struct p *p);
 static void p_destroy(struct p *p);
-static void p_running_push(struct m *m_current, struct p *p_current, struct g *g);
+static void p_running_push(struct p *p_current, struct g *g);
+static void p_running_push_batch(struct p *p_current, struct co **cos, size_t n);
 static struct g *p_running_pop(struct m *m_current, struct p *p_current);
+static struct g *p_pinned_pop(struct p *p_current);
+static struct g *p_class_pop(struct p *p_current);
+static int p_runq_empty(struct p *p);
+static struct g *p_steal(struct m *m_current, struct p *p_current);
+static void runq_put(struct run_queue *q, struct g *g);
+static int runq_put_slow(struct run_queue *q, struct g *g, uint head, uint tail);
+static struct g *runq_get(struct run_queue *q);
+static uint runq_grab(struct run_queue *q, struct run_queue *batch, uint batch_head);
+static struct g *runq_steal(struct run_queue *q, struct run_queue *victim);
+static void globrunq_put_batch(struct run_queue *q, uint head, uint n, struct g *g);
+static struct g *globrunq_get(struct p *p, uint max);
+static uint fastrand(struct m *m);
+static int sysfs_first_cpu(const char *path);
+static void cpu_topo_read(int cpu, struct cpu_topo *topo);
+static int cpu_topo_cmp(const void *a, const void *b);
+static uint cpu_topo_level(const struct cpu_topo *a, const struct cpu_topo *b);
+static void topology_init();
+static void thread_create(pthread_t *thread, int cpu, void *(*start)(void *), void *arg);
 static void mq_init(struct mutex_queue *mq);
 static void mq_destroy(struct mutex_queue *mq);
 static struct list *mq_get(struct mutex_queue *mq);
 static void mq_free(struct mutex_queue *mq);
-static int queue_push(struct loop_queue *q, struct g *g);
-static struct g *queue_pop(struct loop_queue *q);
-static uint queue_size(struct loop_queue *q);
+static void *cache_get(struct free_cache *cache, struct depot *depot);
+static void cache_put(struct free_cache *cache, struct depot *depot, void *obj, void (*release)(void *));
+static void cache_drain(struct free_cache *cache, void (*release)(void *));
+static void depot_init(struct depot *depot);
+static void depot_destroy(struct depot *depot, void (*release)(void *));
+static uint8_t *stack_alloc(struct p *p, size_t size);
+static void stack_free(struct p *p, uint8_t *stack, size_t size);
+static void stack_release(void *stack);
+static struct g *g_alloc(struct p *p);
+static void g_free(struct p *p, struct g *g);
+static void co_unref(struct p *p, struct co *co);
+static int errno_get();
+static void errno_set(int value);
+static void netpoll_init();
+static void netpoll_destroy();
+static int netpoll(struct p *p_current, int timeout);
+static void netpoll_break();
+static struct poll_desc *poll_desc_get(int fd);
+static struct poll_desc *netpoll_open(int fd);
+static int netpoll_wait(struct poll_desc *pd, atomic_uintptr_t *gpp, uint seq);
+static struct g *netpoll_unblock(atomic_uintptr_t *gpp, int ioready);
+static void netpoll_ready(struct p *p_current, struct g *g);
+static struct uring *uring_get(struct m *m_current);
+static struct uring *uring_create();
+static void uring_destroy(struct uring *ring);
+static int uring_prep(struct uring *ring, struct g *g);
+static void uring_submit(struct uring *ring);
+static int uring_reap(struct uring *ring, struct p *p_current);
+static ssize_t io_perform(struct co_io *io);
+static void io_pool_push(struct g *g);
+static void *io_pool_run(void *arg);
+static void io_pool_stop();
+static ssize_t co_file_io(enum co_io_op op, int fd, void *buf, size_t count, off_t offset);
+static void preempt_start();
+static int preempt_find_text(struct dl_phdr_info *info, size_t size, void *data);
+static void preempt_handler(int sig, siginfo_t *info, void *ucontext);
+static void *preempt_monitor(void *arg);
+static void preempt_stop();
+static void timer_wheel_init(struct timer_wheel *wheel);
+static void timer_wheel_insert(struct timer_wheel *wheel, struct timer *timer);
+static uint64_t timer_wheel_next_tick(struct timer_wheel *wheel);
+static void timer_wheel_advance(struct timer_wheel *wheel, uint64_t tick, struct list *expired);
+static void timer_expire(struct timer_wheel *wheel, struct timer *timer, struct list *expired);
+static void timer_add(struct p *p, struct timer *timer);
+static int timer_del(struct timer *timer);
+static void timer_fired(struct timer *timer);
+static int timers_run(struct p *p, struct p *p_current, uint64_t now);
+static int timers_run_all(struct p *p_current);
+static uint64_t timers_next();
+static void sleep_wake(struct timer *timer, struct p *p_current);
+static void timeout_wake(struct timer *timer, struct p *p_current);
+static void g_wake(struct p *p_current, struct g *g);
+static int g_park(struct g *g, struct list *list, pthread_mutex_t *lock, uint64_t deadline);
+static int lock_spin(struct g *g, int iter);
+static void co_mutex_lock_slow(struct co_mutex *mutex);
+static void co_rwlock_wake_writer(struct co_rwlock *rwlock);
+static void waitgroup_init(struct co_waitgroup *wg);
+static void waitgroup_add(struct p *p_current, struct co_waitgroup *wg, int delta);
+static int chan_lock_order(struct co_select_case *cases, int n, struct co_chan **order);
+static void chan_lock_all(struct co_chan **order, int nchan);
+static void chan_unlock_all(struct co_chan **order, int nchan);
+static struct chan_waiter *chan_claim(struct list *queue);
+static int chan_try(struct co_select_case *c, struct chan_waiter **peer);
+static void shared_stack_save(struct co *co);
+static struct parallel_job *parallel_job_new(long grain, size_t size, void *ctx);
+static void parallel_run(struct parallel_task *task);
+static void parallel_split(struct parallel_task *task, long mid);
+static void parallel_entry(void *arg);
+static void shared_stack_restore(struct m *m_current, struct co *co);
 
-static struct co *co_new(const char *name, void (*func)(void *), void *arg, struct g *g);
+static struct co *co_new(const char *name, void (*func)(void *), void *arg, struct g *g,
+                         uint8_t *stack, size_t stack_size);
+static struct g *co_create(struct p *p_current, const char *name, void (*func)(void *), void *arg,
+                           const struct co_attr *attr);
 static void co_wrapper(struct co *co);
-static void co_free(struct co *co);
+static void co_free(struct co *co, struct p *p);
+static void co_context_make(co_context *ctx, uint8_t *stack_top, void (*entry)(struct co *), struct co *arg);
 
-static int queue_push(struct loop_queue *q, struct g *g) {
-    uint new_tail = (q->tail + 1) % RUN_QUEUE_SIZE;
-    if (new_tail == q->head) return 0;
-    q->inner[q->tail] = g;
-    q->tail = new_tail;
-    return 1;
+static void *cache_get(struct free_cache *cache, struct depot *depot) {
+    if (!cache->head) { // refill half of the cache from the depot
+        pthread_mutex_lock(&depot->mutex);
+        while (depot->cache.head && cache->size < P_CACHE_SIZE / 2) {
+            void *obj = depot->cache.head;
+            depot->cache.head = *(void **) obj;
+            depot->cache.size--;
+            *(void **) obj = cache->head;
+            cache->head = obj;
+            cache->size++;
+        }
+        pthread_mutex_unlock(&depot->mutex);
+        if (!cache->head) return NULL;
+    }
+    void *obj = cache->head;
+    cache->head = *(void **) obj;
+    cache->size--;
+    return obj;
 }
 
-static struct g *queue_pop(struct loop_queue *q) {
-    if (q->head == q->tail) return NULL; // empty queue
-    struct g *g = q->inner[q->head++];
-    q->head %= RUN_QUEUE_SIZE;
-    return g;
+static void cache_put(struct free_cache *cache, struct depot *depot, void *obj, void (*release)(void *)) {
+    *(void **) obj = cache->head;
+    cache->head = obj;
+    cache->size++;
+    if (cache->size <= P_CACHE_SIZE) return;
+    // hand half of the cache over to the depot, release what the depot cannot hold
+    struct free_cache overflow = {NULL, 0};
+    pthread_mutex_lock(&depot->mutex);
+    while (cache->size > P_CACHE_SIZE / 2) {
+        obj = cache->head;
+        cache->head = *(void **) obj;
+        cache->size--;
+        struct free_cache *to = depot->cache.size < DEPOT_SIZE ? &depot->cache : &overflow;
+        *(void **) obj = to->head;
+        to->head = obj;
+        to->size++;
+    }
+    pthread_mutex_unlock(&depot->mutex);
+    cache_drain(&overflow, release);
+}
+
+static void cache_drain(struct free_cache *cache, void (*release)(void *)) {
+    while (cache->head) {
+        void *obj = cache->head;
+        cache->head = *(void **) obj;
+        release(obj);
+    }
+    cache->size = 0;
 }
 
-static uint queue_size(struct loop_queue *q) {
-    return (q->tail + RUN_QUEUE_SIZE - q->head) % RUN_QUEUE_SIZE;
+static void depot_init(struct depot *depot) {
+    depot->cache.head = NULL;
+    depot->cache.size = 0;
+    int result = pthread_mutex_init(&depot->mutex, NULL);
+    if (result != 0) {
+        panic("init depot mutex failed");
+    }
 }
 
-static void g_destroy(struct g *g) {
-    co_free(g->co);
-    free(g);
+static void depot_destroy(struct depot *depot, void (*release)(void *)) {
+    cache_drain(&depot->cache, release);
+    pthread_mutex_destroy(&depot->mutex);
 }
 
-static void p_init(struct p *p) {
-    p->all_queue.head = 0;
-    p->all_queue.tail = 0;
-    p->running_queue.head = 0;
-    p->running_queue.tail = 0;
-    p->dead_queue.head = 0;
-    p->dead_queue.tail = 0;
+// map a stack of size bytes (a multiple of page_size) with a PROT_NONE guard page below it,
+// pages are only committed once touched; stacks of the default size come from p's cache unless p == NULL
+static uint8_t *stack_alloc(struct p *p, size_t size) {
+    if (p && size == co_stack_size) {
+        uint8_t *stack = cache_get(&p->stack_cache, &stack_depot);
+        if (stack) return stack;
+    }
+    uint8_t *region = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (region == MAP_FAILED) {
+        panic("mmap coroutine stack failed");
+        return NULL;
+    }
+    if (mprotect(region, page_size, PROT_NONE) != 0) {
+        panic("mprotect stack guard page failed");
+        return NULL;
+    }
+    return region + page_size;
 }
 
-static void p_destroy(struct p *p) {
-    struct loop_queue *q = &p->all_queue;
-    for (uint i = q->head; i != q->tail; i = (i + 1) % RUN_QUEUE_SIZE) {
-        g_destroy(q->inner[i]);
+// p == NULL unmaps the stack directly
+static void stack_free(struct p *p, uint8_t *stack, size_t size) {
+    if (p && size == co_stack_size) {
+        cache_put(&p->stack_cache, &stack_depot, stack, stack_release);
+        return;
     }
+    munmap(stack - page_size, size + page_size);
 }
 
-static void p_running_push(struct m *m_current, struct p *p_current, struct g *g) {
-    uint size = queue_size(&p_current->running_queue);
-    uint target_size = MIN((atomic_load_explicit(&co_num, memory_order_acquire) + M_NUM - 1) / M_NUM, RUN_QUEUE_SIZE - 1);
-    if (target_size != 0 && size > (target_size << 1)) {
-        struct list *gq_inner = mq_get(&global_queue);
-        while (size > target_size - 1) {
-            struct g *g_push = queue_pop(&p_current->running_queue);
-            g_push->m = NULL;
-            list_push_back(gq_inner, g_push);
-            size--;
-        }
-        mq_free(&global_queue);
+// release a cached stack of the default size
+static void stack_release(void *stack) {
+    munmap((uint8_t *) stack - page_size, co_stack_size + page_size);
+}
+
+// p == NULL mallocs a block that g_destroy frees, the g0s are allocated so
+static struct g *g_alloc(struct p *p) {
+    struct g_block *block = p ? cache_get(&p->g_cache, &g_depot) : NULL;
+    if (!block) block = (struct g_block *) malloc(sizeof(struct g_block));
+    if (!block) {
+        panic("malloc struct g_block failed");
+        return NULL;
     }
-    g->m = m_current;
-    if (!queue_push(&p_current->running_queue, g)) {
-        panic("running queue is still full after balancing overhead");
+    block->g.co = &block->co;
+    block->g.pinned = NULL;
+    block->g.priority = CO_PRIORITY_NORMAL;
+    block->co.g = &block->g;
+    return &block->g;
+}
+
+static void g_destroy(struct g *g) {
+    co_free(g->co, NULL);
+    free(g); // the whole g_block
+}
+
+// recycle the g_block of a dead coroutine through p's cache
+static void g_free(struct p *p, struct g *g) {
+    co_free(g->co, p);
+    cache_put(&p->g_cache, &g_depot, g, free);
+}
+
+// drop a reference to co, the last one frees it
+static void co_unref(struct p *p, struct co *co) {
+    if (atomic_fetch_sub_explicit(&co->refs, 1, memory_order_acq_rel) == 1) {
+        g_free(p, co->g);
     }
 }
 
-static struct g *p_running_pop(struct m *m_current, struct p *p_current) {
-    uint size = queue_size(&p_current->running_queue);
-    uint target_size = MIN((atomic_load_explicit(&co_num, memory_order_acquire) + M_NUM - 1) / M_NUM, RUN_QUEUE_SIZE - 1);
-    if (size < ((target_size + 1) >> 1)) {
-        struct list *gq_inner = mq_get(&global_queue);
-        while (size < target_size) {
-            struct g *g_pop = list_pop_front(gq_inner);
-            if (!g_pop) break;
-            g_pop->m = m_current;
-            queue_push(&p_current->running_queue, g_pop);
-            size++;
+static void p_init(struct p *p) {
+    p->schedtick = 0;
+    p->stack_cache.head = NULL;
+    p->stack_cache.size = 0;
+    p->g_cache.head = NULL;
+    p->g_cache.size = 0;
+    for (int i = 0; i < PRIORITY_CLASSES; i++) {
+        struct run_queue *q = &p->running_queues[i];
+        atomic_init(&q->head, 0);
+        atomic_init(&q->tail, 0);
+        q->mask = run_queue_size - 1;
+        q->inner = calloc(run_queue_size, sizeof(struct g *));
+        if (!q->inner) {
+            panic("malloc running queue failed");
         }
-        mq_free(&global_queue);
     }
-    return queue_pop(&p_current->running_queue);
+    mq_init(&p->pinned_queue);
+    atomic_init(&p->pinned_size, 0);
+    timer_wheel_init(&p->timers);
 }
 
-static void mq_init(struct mutex_queue *mq) {
-    list_init(&mq->queue);
-    mq->mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
-    int result = pthread_mutex_init(&mq->mutex, NULL);
-    if (result != 0) {
-        panic("init global queue mutex failed");
+static void p_destroy(struct p *p) {
+    // coroutines still alive at exit are not tracked, the process is going away with them
+    cache_drain(&p->stack_cache, stack_release);
+    cache_drain(&p->g_cache, free);
+    for (int i = 0; i < PRIORITY_CLASSES; i++) {
+        free(p->running_queues[i].inner);
     }
+    free(p->steal_order);
+    mq_destroy(&p->pinned_queue);
+    pthread_mutex_destroy(&p->timers.mutex);
 }
 
-static void mq_destroy(struct mutex_queue *mq) {
-    list_destroy(&mq->queue);
-    pthread_mutex_destroy(&mq->mutex);
+static void p_running_push(struct p *p_current, struct g *g) {
+    if (!g->pinned) {
+        runq_put(&p_current->running_queues[g->priority], g);
+        return;
+    }
+    struct p *p = g->pinned;
+    struct list *pq_inner = mq_get(&p->pinned_queue);
+    list_push_back(pq_inner, &g->link);
+    atomic_fetch_add_explicit(&p->pinned_size, 1, memory_order_seq_cst);
+    mq_free(&p->pinned_queue);
+    if (p != p_current) {
+        m_wakeup_pinned(&m_set[p - p_set]);
+    }
 }
 
-static struct list *mq_get(struct mutex_queue *mq) {
-    pthread_mutex_lock(&mq->mutex);
-    return &mq->queue;
+// push the new coroutines of a co_start_batch in one go: as many as fit into p_current's running queue
+// are published with a single tail store, the rest go to the injection queue of its node under one lock
+static void p_running_push_batch(struct p *p_current, struct co **cos, size_t n) {
+    struct run_queue *q = &p_current->running_queues[CO_PRIORITY_NORMAL];
+    uint head = atomic_load_explicit(&q->head, memory_order_acquire);
+    uint tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t k = MIN(n, (size_t) (q->mask + 1 - (tail - head)));
+    for (size_t i = 0; i < k; i++) {
+        atomic_store_explicit(&q->inner[(tail + i) & q->mask], cos[i]->g, memory_order_relaxed);
+    }
+    atomic_store_explicit(&q->tail, tail + (uint) k, memory_order_release);
+    if (k == n) return;
+    struct mutex_queue *gq = &node_queues[q->node];
+    struct list *gq_inner = mq_get(gq);
+    for (size_t i = k; i < n; i++) {
+        list_push_back(gq_inner, &cos[i]->g->link);
+    }
+    atomic_fetch_add_explicit(&global_queue_size, n - k, memory_order_relaxed);
+    mq_free(gq);
 }
 
-static void mq_free(struct mutex_queue *mq) {
-    pthread_mutex_unlock(&mq->mutex);
+static struct g *p_pinned_pop(struct p *p_current) {
+    if (atomic_load_explicit(&p_current->pinned_size, memory_order_relaxed) == 0) return NULL;
+    struct list *pq_inner = mq_get(&p_current->pinned_queue);
+    struct node *node = list_pop_front(pq_inner);
+    if (node) atomic_fetch_sub_explicit(&p_current->pinned_size, 1, memory_order_relaxed);
+    mq_free(&p_current->pinned_queue);
+    return node ? list_entry(node, struct g, link) : NULL;
 }
 
-static struct g *g_get_current() {
-    struct g **tls_data_g_current = (struct g **)pthread_getspecific(tls_key_g_current);
-    return *tls_data_g_current;
+static struct g *p_running_pop(struct m *m_current, struct p *p_current) {
+    struct g *g;
+    if (atomic_load_explicit(&p_current->timers.next_when, memory_order_relaxed) != TIMER_NONE) {
+        timers_run(p_current, p_current, co_now());
+    }
+    // let ready fds and the global queue in once in a while,
+    // otherwise two coroutines yielding to each other could starve them
+    if (++p_current->schedtick % GLOBAL_QUEUE_TICK == 0) {
+        if (m_current->uring) uring_submit(m_current->uring);
+        if (atomic_load_explicit(&netpoll_waiters, memory_order_relaxed) > 0
+            && !atomic_load_explicit(&netpoll_blocked, memory_order_relaxed)) {
+            netpoll(p_current, 0);
+        }
+        if (atomic_load_explicit(&global_queue_size, memory_order_relaxed) > 0
+            && (g = globrunq_get(p_current, 1))) {
+            return g;
+        }
+    }
+    // alternate between pinned and stealable coroutines, so that neither kind starves the other
+    if (p_current->schedtick & 1) {
+        if ((g = p_pinned_pop(p_current))) return g;
+        if ((g = p_class_pop(p_current))) return g;
+    } else {
+        if ((g = p_class_pop(p_current))) return g;
+        if ((g = p_pinned_pop(p_current))) return g;
+    }
+    if (atomic_load_explicit(&global_queue_size, memory_order_relaxed) > 0) {
+        if ((g = globrunq_get(p_current, 0))) return g;
+    }
+    return NULL;
 }
 
-static struct m *m_get_current() {
-    struct g **tls_data_g_current = (struct g **)pthread_getspecific(tls_key_g_current);
-    struct g *g_current = *tls_data_g_current;
-    return g_current->m;
+// weighted pick between the classes of stealable coroutines: latency-critical ones get CRITICAL_WEIGHT picks
+// for every normal one, background ones run when nothing else is queued, or once every BACKGROUND_TICK picks
+// so that they cannot starve
+static struct g *p_class_pop(struct p *p_current) {
+    struct run_queue *queues = p_current->running_queues;
+    uint tick = p_current->schedtick;
+    struct g *g;
+    if (tick % BACKGROUND_TICK == 0 && (g = runq_get(&queues[CO_PRIORITY_BACKGROUND]))) return g;
+    if (tick % (CRITICAL_WEIGHT + 1) != 0) {
+        if ((g = runq_get(&queues[CO_PRIORITY_CRITICAL]))) return g;
+        if ((g = runq_get(&queues[CO_PRIORITY_NORMAL]))) return g;
+    } else {
+        if ((g = runq_get(&queues[CO_PRIORITY_NORMAL]))) return g;
+        if ((g = runq_get(&queues[CO_PRIORITY_CRITICAL]))) return g;
+    }
+    return runq_get(&queues[CO_PRIORITY_BACKGROUND]);
 }
 
-static void *m_run_coroutine(void *ptr) {
-    struct g *g0 = (struct g *) ptr;
-    // init TLS data
-    struct g **tls_data_g_current = malloc(sizeof(struct g *));
-    pthread_setspecific(tls_key_g_current, tls_data_g_current);
-    *tls_data_g_current = g0;
-    // current m, loop_queue
-    struct m *m_current = g0->m;
-    struct p *p_current = m_current->p;
-    // schedule
-    int val = CO_SCHEDULE;
-    while (!atomic_load_explicit(&exit_signal, memory_order_acquire)) {
-        if (val == CO_SCHEDULE) { // run next
-            struct g *g_next = p_running_pop(m_current, p_current);
-            if (g_next) {
-                if (g_next->m != m_current) {
-                    panic("g_next's m is not current m");
-                }
-                *tls_data_g_current = g_next;
-                struct co *co_current = g_next->co;
-                val = setjmp(g0->co->context);
-                if (val == 0) {
-                    if (co_current->status == CO_NEW) {
-//                        printf("[tid: %lu] new coroutine starts to run, %s\n", pthread_self(), co_current->name);
-                        stack_switch_call(co_current->stack + CO_STACK_SIZE, co_wrapper, (uintptr_t) co_current);
-                    } else if (co_current->status == CO_RUNNING) {
-                        longjmp(co_current->context, 1);
-                    } else {
-//                        printf("coroutine status: %d\n", co_current->status);
-                        panic("invalid coroutine status");
-                    }
-                } else {
-                    continue;
-                }
-            }
-        } else if (val == CO_YIELD) { // suspend
-//            printf("suspend coroutine\n");
-            struct g *g_current = *tls_data_g_current;
-            p_running_push(m_current, p_current, g_current);
-            *tls_data_g_current = g0;
-            val = CO_SCHEDULE;
-        } else if (val == CO_EXIT) { // exit
-            struct g *g_current = *tls_data_g_current;
-            struct co *co = g_current->co;
-            // erase from running list and free stack
-            queue_push(&p_current->dead_queue, g_current);
-            free(co->stack);
-            co->stack = NULL;
-            // set status to CO_DEAD and wake up all waiters
-            pthread_mutex_lock(&co->status_mutex);
-            co->status = CO_DEAD;
-            struct list *waiters = &co->waiters;
-            while (!list_is_empty(waiters)) {
-                struct co *waiter = (struct co *) list_pop_front(waiters);
-                if (waiter == co_main) {
-                    sem_post(&co_main_sem); // wake up main coroutine
-                    pthread_mutex_unlock(&co->status_mutex);
-                    continue;
-                }
-                pthread_mutex_lock(&waiter->status_mutex);
-                if (waiter->status == CO_WAITING) {
-                    waiter->status = CO_RUNNING;
-                    struct list *gq_inner = mq_get(&global_queue);
-                    list_push_back(gq_inner, waiter->g);
-                    mq_free(&global_queue);
-                } else {
-                    pthread_mutex_unlock(&waiter->status_mutex);
-                    panic("waiter status is not CO_WAITING");
+static int p_runq_empty(struct p *p) {
+    for (int i = 0; i < PRIORITY_CLASSES; i++) {
+        struct run_queue *q = &p->running_queues[i];
+        if (atomic_load_explicit(&q->tail, memory_order_seq_cst) != atomic_load_explicit(&q->head, memory_order_seq_cst)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// steal half of the coroutines of one class from another P, latency-critical ones first and background ones last;
+// nearer victims first so that coroutines move between caches as little as possible,
+// victims equally far away are visited from a random start
+static struct g *p_steal(struct m *m_current, struct p *p_current) {
+    static const enum co_priority order[PRIORITY_CLASSES] = {
+            CO_PRIORITY_CRITICAL, CO_PRIORITY_NORMAL, CO_PRIORITY_BACKGROUND
+    };
+    for (int round = 0; round < STEAL_ROUNDS; round++) {
+        for (int c = 0; c < PRIORITY_CLASSES; c++) {
+            uint begin = 0;
+            for (int level = 0; level < TOPO_LEVELS; level++) {
+                uint end = p_current->steal_end[level], n = end - begin;
+                uint offset = n ? fastrand(m_current) % n : 0;
+                for (uint i = 0; i < n; i++) {
+                    struct p *victim = &p_set[p_current->steal_order[begin + (offset + i) % n]];
+                    struct g *g = runq_steal(&p_current->running_queues[order[c]], &victim->running_queues[order[c]]);
+                    if (g) return g;
                 }
-                pthread_mutex_unlock(&waiter->status_mutex);
-            }
-            pthread_mutex_unlock(&co->status_mutex);
-            *tls_data_g_current = g0;
-            val = CO_SCHEDULE;
-        } else if (val == CO_WAIT) { // wait
-            struct g *g_current = *tls_data_g_current;
-            struct co *co_current = g_current->co, *to_be_waited = p_current->to_be_waited;
-            // add to waiters
-            pthread_mutex_lock(&to_be_waited->status_mutex);
-            if (to_be_waited->status == CO_DEAD) {
-                pthread_mutex_unlock(&to_be_waited->status_mutex);
-                return NULL;
+                begin = end;
             }
-            list_push_back(&to_be_waited->waiters, co_current);
-            g_current->m = NULL;
-            // set co_current's status to CO_WAITING
-            // do not free to_be_waited mutex here
-            pthread_mutex_lock(&co_current->status_mutex);
-            co_current->status = CO_WAITING;
-            pthread_mutex_unlock(&co_current->status_mutex);
-            pthread_mutex_unlock(&to_be_waited->status_mutex);
-            *tls_data_g_current = g0;
-            val = CO_SCHEDULE;
-        } else { // sem_wait
-            struct g *g_current = *tls_data_g_current;
-            struct co *co_current = g_current->co;
-            struct co_sem *sem = p_current->blocked_sem;
-            g_current->m = NULL;
-            list_push_back(&sem->waiters, co_current);
-            pthread_mutex_lock(&co_current->status_mutex);
-            co_current->status = CO_WAITING;
-            pthread_mutex_unlock(&co_current->status_mutex);
-            pthread_mutex_unlock(&sem->mutex);
-            *tls_data_g_current = g0;
-            val = CO_SCHEDULE;
         }
     }
-//    free(tls_data_g_current);
     return NULL;
 }
 
-static void co_wrapper(struct co *co) {
-    co->status = CO_RUNNING;
-    co->func(co->arg);
-//    stack_switch_call(co_runtime_stack + CO_RUNTIME_STACK_SIZE, co_exit, (uintptr_t) co);
-    atomic_fetch_sub_explicit(&co_num, 1, memory_order_acq_rel);
-    longjmp(m_get_current()->g0->co->context, CO_EXIT); // exit coroutine
+static void runq_put(struct run_queue *q, struct g *g) {
+    while (1) {
+        uint head = atomic_load_explicit(&q->head, memory_order_acquire);
+        uint tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        if (tail - head <= q->mask) {
+            atomic_store_explicit(&q->inner[tail & q->mask], g, memory_order_relaxed);
+            atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+            return;
+        }
+        if (runq_put_slow(q, g, head, tail)) return;
+        // thieves have made room in the meantime, retry
+    }
 }
 
-static void co_free(struct co *co) {
-    if (co->stack) {
-        free(co->stack);
-        co->stack = NULL;
-    }
-    if (co->name) {
-        free(co->name);
-        co->name = NULL;
+// move half of a full local queue together with g to the global queue
+static int runq_put_slow(struct run_queue *q, struct g *g, uint head, uint tail) {
+    uint n = (tail - head) / 2;
+    if (!atomic_compare_exchange_strong_explicit(&q->head, &head, head + n,
+                                                 memory_order_acq_rel, memory_order_relaxed)) {
+        return 0;
     }
-    list_destroy(&co->waiters);
-    pthread_mutex_destroy(&co->status_mutex);
-    free(co);
+    // the claimed slots stay intact, only the owner (the caller) writes to the queue
+    globrunq_put_batch(q, head, n, g);
+    return 1;
 }
 
-struct co *co_new(const char *name, void (*func)(void *), void *arg, struct g *g) {
-    if (!name) {
-        panic("name or func is NULL");
-        return NULL;
+static struct g *runq_get(struct run_queue *q) {
+    uint head = atomic_load_explicit(&q->head, memory_order_acquire);
+    while (1) {
+        uint tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        if (head == tail) return NULL;
+        struct g *g = atomic_load_explicit(&q->inner[head & q->mask], memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&q->head, &head, head + 1,
+                                                  memory_order_release, memory_order_acquire)) {
+            return g;
+        }
     }
-    struct co *co = (struct co *) malloc(sizeof(struct co));
-    if (!co) {
-        panic("malloc struct_co failed");
-        return NULL;
+}
+
+// copy half of q into batch starting at batch_head, return the number of coroutines grabbed
+static uint runq_grab(struct run_queue *q, struct run_queue *batch, uint batch_head) {
+    while (1) {
+        uint head = atomic_load_explicit(&q->head, memory_order_acquire);
+        uint tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        uint n = tail - head;
+        n = n - n / 2;
+        if (n == 0) return 0;
+        if (n > (q->mask + 1) / 2) continue; // head and tail read inconsistently
+        for (uint i = 0; i < n; i++) {
+            struct g *g = atomic_load_explicit(&q->inner[(head + i) & q->mask], memory_order_relaxed);
+            atomic_store_explicit(&batch->inner[(batch_head + i) & batch->mask], g, memory_order_relaxed);
+        }
+        if (atomic_compare_exchange_strong_explicit(&q->head, &head, head + n,
+                                                    memory_order_release, memory_order_relaxed)) {
+            return n;
+        }
     }
-    co->g = g;
-    co->name = (char *) malloc(strlen(name) + 1);
-    if (!co->name) {
-        panic("malloc data->name failed");
-        return NULL;
+}
+
+// steal half of victim into q and return one of the stolen coroutines, q must be owned by the caller
+static struct g *runq_steal(struct run_queue *q, struct run_queue *victim) {
+    uint tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint n = runq_grab(victim, q, tail);
+    if (n == 0) return NULL;
+    n--;
+    struct g *g = atomic_load_explicit(&q->inner[(tail + n) & q->mask], memory_order_relaxed);
+    if (n == 0) return g;
+    uint head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - head + n > q->mask) {
+        panic("running queue overflows after stealing");
     }
-    strcpy(co->name, name);
-    co->stack = (uint8_t *) malloc(CO_STACK_SIZE);
-    if (!co->stack) {
-        panic("malloc data->stack failed");
-        return NULL;
+    atomic_store_explicit(&q->tail, tail + n, memory_order_release);
+    return g;
+}
+
+// move n coroutines of q starting at head, followed by g, to the global queue
+static void globrunq_put_batch(struct run_queue *q, uint head, uint n, struct g *g) {
+    struct mutex_queue *gq = &node_queues[q->node];
+    struct list *gq_inner = mq_get(gq);
+    for (uint i = 0; i < n; i++) {
+        struct g *spilled = atomic_load_explicit(&q->inner[(head + i) & q->mask], memory_order_relaxed);
+        list_push_back(gq_inner, &spilled->link);
     }
-    co->func = func;
-    co->arg = arg;
-    co->status = CO_NEW;
-    list_init(&co->waiters);
-    co->status_mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
-    int result = pthread_mutex_init(&co->status_mutex, NULL);
-    if (result != 0) {
-        co_free(co);
-        panic("init global queue mutex failed");
-        return NULL;
+    list_push_back(gq_inner, &g->link);
+    atomic_fetch_add_explicit(&global_queue_size, n + 1, memory_order_relaxed);
+    mq_free(gq);
+}
+
+// take a fair share of the injection queues into p's running queue, those of its own node first,
+// max == 0 means no limit
+static struct g *globrunq_get(struct p *p, uint max) {
+    for (uint i = 0; i < node_num; i++) {
+        struct mutex_queue *gq = &node_queues[(p->running_queues[0].node + i) % node_num];
+        struct list *gq_inner = mq_get(gq);
+        uint size = gq_inner->size;
+        if (size == 0) {
+            mq_free(gq);
+            continue;
+        }
+        uint n = MIN(size / m_num + 1, size);
+        if (max > 0) n = MIN(n, max);
+        n = MIN(n, (p->running_queues[0].mask + 1) / 2);
+        atomic_fetch_sub_explicit(&global_queue_size, n, memory_order_relaxed);
+        struct g *g = list_entry(list_pop_front(gq_inner), struct g, link);
+        for (uint j = 1; j < n; j++) {
+            struct g *next = list_entry(list_pop_front(gq_inner), struct g, link);
+            runq_put(&p->running_queues[next->priority], next);
+        }
+        mq_free(gq);
+        return g;
     }
-    return co;
+    return NULL;
 }
 
-struct co *co_start(const char *name, void (*func)(void *), void *arg) {
-//    printf("co_start\n");
-    struct m *m_current = m_get_current();
-    struct p *p_current = m_current->p;
-    struct g *g = malloc(sizeof(struct g));
-    struct co * co = co_new(name, func, arg, g);
-    g->co = co;
-    atomic_fetch_add_explicit(&co_num, 1, memory_order_acq_rel);
-    queue_push(&p_current->all_queue, g);
-    if (m_current == &m_set[0]) { // main thread
-        struct list *gq_inner = mq_get(&global_queue);
-        list_push_back(gq_inner, g);
-        mq_free(&global_queue);
-    } else { // other thread
-        p_running_push(m_current, p_current, g);
+static uint fastrand(struct m *m) {
+    // xorshift32
+    uint x = m->rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    m->rand_state = x;
+    return x;
+}
+
+// find a coroutine to run, spin on stealing for a while and then park until there is work
+// return NULL once the runtime exits
+static struct g *m_find_runnable(struct m *m_current, struct p *p_current) {
+    while (!atomic_load_explicit(&exit_signal, memory_order_acquire)) {
+        struct g *g = p_running_pop(m_current, p_current);
+        if (g) return g;
+        // fire the timers of Ps whose Ms are parked or busy
+        if (timers_run_all(p_current) > 0) continue;
+        // the round is over, send the file I/O staged by its coroutines in one go
+        struct uring *ring = m_current->uring;
+        if (ring) {
+            uring_submit(ring);
+            if (atomic_load_explicit(&ring->inflight, memory_order_relaxed) > 0 && uring_reap(ring, p_current) > 0) {
+                continue;
+            }
+        }
+        if (atomic_load_explicit(&netpoll_waiters, memory_order_relaxed) > 0 && netpoll(p_current, 0) > 0) {
+            continue;
+        }
+        if (!m_current->spinning) {
+            m_current->spinning = 1;
+            atomic_fetch_add_explicit(&m_spinning_num, 1, memory_order_seq_cst);
+        }
+        // p_steal sweeps the other Ps STEAL_ROUNDS times itself
+        if ((g = p_steal(m_current, p_current))) return g;
+        if ((g = globrunq_get(p_current, 0))) return g;
+        m_park(m_current);
     }
-    return co;
+    return NULL;
 }
 
-void co_yield() {
-//    printf("co_yield\n");
-    struct g *g_current = g_get_current();
-    if (g_current->co == co_main) return; // do not yield in main coroutine
-    int val = setjmp(g_current->co->context);
-    if (val == 0) { // suspend
-        longjmp(g_current->m->g0->co->context, CO_YIELD); // jump to scheduler
-    } else { // resume
-        return;
+// the M found work, hand the spinning role over to an idle M in case there is more
+static void m_reset_spinning(struct m *m_current) {
+    if (!m_current->spinning) return;
+    m_current->spinning = 0;
+    if (atomic_fetch_sub_explicit(&m_spinning_num, 1, memory_order_seq_cst) == 1) {
+        m_wakeup();
     }
 }
 
-void co_wait(struct co *co) {
-//    printf("co_wait\n");
-    if (!co || co == co_main) {
-        panic("co is NULL or main coroutine");
+static void m_park(struct m *m_current) {
+    // file I/O the kernel had no room for is only entered by this M, nap for a tick and retry instead of parking
+    struct uring *ring = m_current->uring;
+    if (ring && ring->to_submit > 0) {
+        struct timespec nap = {0, TIMER_TICK_NS};
+        nanosleep(&nap, NULL);
         return;
     }
-    struct g *g_current = g_get_current();
-    struct m *m_current = g_current->m;
-    if (g_current->co == co_main) { // main coroutine waits others
-//        printf("main coroutine waits others\n");
-        pthread_mutex_lock(&co->status_mutex);
-        if (co->status == CO_DEAD) {
-            pthread_mutex_unlock(&co->status_mutex);
-            return;
+    // while coroutines wait on fds or timers, one M blocks in epoll_wait until the nearest deadline
+    // instead of the futex, the other Ms park without a timeout
+    if ((atomic_load_explicit(&netpoll_waiters, memory_order_seq_cst) > 0 || timers_next() != TIMER_NONE)
+        && !atomic_exchange_explicit(&netpoll_blocked, 1, memory_order_seq_cst)) {
+        m_current->spinning = 0;
+        atomic_fetch_sub_explicit(&m_spinning_num, 1, memory_order_seq_cst);
+        // publish the deadline before reading the wheels again, timer_add breaks us if it adds an earlier one
+        atomic_store_explicit(&netpoll_until, timers_next(), memory_order_seq_cst);
+        uint64_t until = timers_next();
+        if (!work_available(m_current->p) && !atomic_load_explicit(&exit_signal, memory_order_seq_cst)) {
+            int timeout = -1; // m_wakeup breaks it when there is no idle M to wake
+            if (until != TIMER_NONE) {
+                uint64_t now = co_now();
+                timeout = until <= now ? 0 : (int) MIN((until - now + TIMER_TICK_NS - 1) / TIMER_TICK_NS, INT_MAX);
+            }
+            if (timeout != 0) netpoll(m_current->p, timeout);
         }
-        list_push_back(&co->waiters, co_main);
-        pthread_mutex_unlock(&co->status_mutex);
-        sem_wait(&co_main_sem);
+        atomic_store_explicit(&netpoll_until, 0, memory_order_seq_cst);
+        atomic_store_explicit(&netpoll_blocked, 0, memory_order_seq_cst);
+        m_current->spinning = 1;
+        atomic_fetch_add_explicit(&m_spinning_num, 1, memory_order_seq_cst);
         return;
     }
-    m_current->p->to_be_waited = co;
-    int val = setjmp(g_current->co->context);
-    if (val == 0) {
-        longjmp(m_current->g0->co->context, CO_WAIT); // jump to scheduler
-    } else { // resume
+    atomic_store_explicit(&m_current->park_word, 0, memory_order_seq_cst);
+    pthread_mutex_lock(&m_idle_mutex);
+    m_current->idle_next = m_idle_list;
+    m_idle_list = m_current;
+    atomic_fetch_add_explicit(&m_idle_num, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&m_idle_mutex);
+    // stop spinning only after becoming idle, so that a submitter sees us as either spinning or idle
+    m_current->spinning = 0;
+    atomic_fetch_sub_explicit(&m_spinning_num, 1, memory_order_seq_cst);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (work_available(m_current->p) && m_idle_remove(m_current)) {
+        m_current->spinning = 1;
+        atomic_fetch_add_explicit(&m_spinning_num, 1, memory_order_seq_cst);
         return;
     }
+    // either nothing to do, or someone has already taken us off the idle list and is waking us up
+    while (atomic_load_explicit(&m_current->park_word, memory_order_seq_cst) == 0
+           && !atomic_load_explicit(&exit_signal, memory_order_seq_cst)) {
+        futex_wait(&m_current->park_word, 0);
+    }
+    m_current->spinning = 1; // the waker counted us in m_spinning_num
 }
 
-static void tls_destructor(void *ptr) {
-    free(ptr);
+static int m_idle_remove(struct m *m_current) {
+    int removed = 0;
+    pthread_mutex_lock(&m_idle_mutex);
+    for (struct m **pm = &m_idle_list; *pm; pm = &(*pm)->idle_next) {
+        if (*pm == m_current) {
+            *pm = m_current->idle_next;
+            atomic_fetch_sub_explicit(&m_idle_num, 1, memory_order_relaxed);
+            removed = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&m_idle_mutex);
+    return removed;
 }
 
-void co_init() {
-    // init TLS key
-    pthread_key_create(&tls_key_g_current, tls_destructor);
-    // init global queue
-    mq_init(&global_queue);
-    // init semaphore of main
-    sem_init(&co_main_sem, 0, 0);
-    // main coroutine occupies main thread
-    for (int i = 0; i < M_NUM; i++) {
-        p_init(&p_set[i]);
-        m_set[i].g0 = malloc(sizeof(struct g));
-        m_set[i].p = &p_set[i];
-        m_set[i].g0->m = &m_set[i];
+// called after new coroutines become runnable: unpark one M unless some M is already spinning,
+// a spinning M that finds work wakes the next one (see m_reset_spinning)
+static void m_wakeup() {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&m_spinning_num, memory_order_seq_cst) != 0) return;
+    if (atomic_load_explicit(&m_idle_num, memory_order_seq_cst) == 0) {
+        if (atomic_load_explicit(&netpoll_blocked, memory_order_seq_cst)) netpoll_break();
+        return;
     }
-    m_set[0].thread_id = pthread_self();
-    co_main = co_new("co_main", NULL, NULL, m_set[0].g0);
-    m_set[0].g0->co = co_main;
+    int expected = 0;
+    if (!atomic_compare_exchange_strong_explicit(&m_spinning_num, &expected, 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return;
+    }
+    pthread_mutex_lock(&m_idle_mutex);
+    struct m *m = m_idle_list;
+    if (m) {
+        m_idle_list = m->idle_next;
+        atomic_fetch_sub_explicit(&m_idle_num, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&m_idle_mutex);
+    if (!m) {
+        atomic_fetch_sub_explicit(&m_spinning_num, 1, memory_order_seq_cst);
+        return;
+    }
+    atomic_store_explicit(&m->park_word, 1, memory_order_release);
+    futex_wake(&m->park_word);
+}
+
+// called after n coroutines become runnable at once: unpark idle Ms until there are as many Ms looking for work
+// as new coroutines, taking them off the idle list under one lock
+static void m_wakeup_many(size_t n) {
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t spinning = (size_t) atomic_load_explicit(&m_spinning_num, memory_order_seq_cst);
+    if (spinning >= n) return;
+    struct m *woken = NULL;
+    int k = 0;
+    pthread_mutex_lock(&m_idle_mutex);
+    while (m_idle_list && spinning + k < n) {
+        struct m *m = m_idle_list;
+        m_idle_list = m->idle_next;
+        m->idle_next = woken;
+        woken = m;
+        k++;
+    }
+    if (k > 0) {
+        atomic_fetch_sub_explicit(&m_idle_num, k, memory_order_relaxed);
+        atomic_fetch_add_explicit(&m_spinning_num, k, memory_order_seq_cst);
+    }
+    pthread_mutex_unlock(&m_idle_mutex);
+    if (spinning + k < n && atomic_load_explicit(&netpoll_blocked, memory_order_seq_cst)) netpoll_break();
+    while (woken) {
+        struct m *m = woken;
+        woken = m->idle_next; // m reuses idle_next once it runs
+        atomic_store_explicit(&m->park_word, 1, memory_order_release);
+        futex_wake(&m->park_word);
+    }
+}
+
+// unpark m if it is idle, it has to run a coroutine pinned to it
+static void m_wakeup_pinned(struct m *m) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!m_idle_remove(m)) { // m is running, blocked in netpoll or will recheck its pinned queue before parking
+        if (atomic_load_explicit(&netpoll_blocked, memory_order_seq_cst)) netpoll_break();
+        return;
+    }
+    atomic_fetch_add_explicit(&m_spinning_num, 1, memory_order_seq_cst);
+    atomic_store_explicit(&m->park_word, 1, memory_order_release);
+    futex_wake(&m->park_word);
+}
+
+// a coroutine pinned to another P is not work for p_current
+static int work_available(struct p *p_current) {
+    if (atomic_load_explicit(&global_queue_size, memory_order_seq_cst) > 0) return 1;
+    if (atomic_load_explicit(&p_current->pinned_size, memory_order_seq_cst) > 0) return 1;
+    for (uint i = 0; i < m_num; i++) {
+        if (!p_runq_empty(&p_set[i])) return 1;
+    }
+    return 0;
+}
+
+static void futex_wait(atomic_uint *addr, uint val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void mq_init(struct mutex_queue *mq) {
+    list_init(&mq->queue);
+    mq->mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    int result = pthread_mutex_init(&mq->mutex, NULL);
+    if (result != 0) {
+        panic("init global queue mutex failed");
+    }
+}
+
+static void mq_destroy(struct mutex_queue *mq) {
+    list_destroy(&mq->queue);
+    pthread_mutex_destroy(&mq->mutex);
+}
+
+static struct list *mq_get(struct mutex_queue *mq) {
+    pthread_mutex_lock(&mq->mutex);
+    return &mq->queue;
+}
+
+static void mq_free(struct mutex_queue *mq) {
+    pthread_mutex_unlock(&mq->mutex);
+}
+
+// errno is thread-local and a coroutine may resume on another M, so code that may switch in between
+// goes through these, the compiler could otherwise reuse the address of errno taken before the switch
+__attribute__((noipa))
+static int errno_get() {
+    return errno;
+}
+
+__attribute__((noipa))
+static void errno_set(int value) {
+    errno = value;
+}
+
+static void netpoll_init() {
+    netpoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    netpoll_break_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (netpoll_fd < 0 || netpoll_break_fd < 0) {
+        panic("create epoll or eventfd failed");
+        return;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL}; // a NULL poll_desc marks the eventfd
+    if (epoll_ctl(netpoll_fd, EPOLL_CTL_ADD, netpoll_break_fd, &ev) != 0) {
+        panic("register eventfd with epoll failed");
+        return;
+    }
+    // fds are bounded by the hard limit, the soft one may still be raised
+    struct rlimit limit;
+    rlim_t max_fds = POLL_DESC_MAX_FDS;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_max != RLIM_INFINITY) {
+        max_fds = MIN(limit.rlim_max, POLL_DESC_MAX_FDS);
+    }
+    poll_desc_chunk_num = (max_fds + POLL_DESC_CHUNK - 1) / POLL_DESC_CHUNK;
+    poll_desc_chunks = calloc(poll_desc_chunk_num, sizeof(struct poll_desc *));
+    if (!poll_desc_chunks) {
+        panic("malloc poll descriptors failed");
+    }
+}
+
+static void netpoll_destroy() {
+    for (uint i = 0; i < poll_desc_chunk_num; i++) {
+        free(poll_desc_chunks[i]);
+    }
+    free(poll_desc_chunks);
+    close(netpoll_break_fd);
+    close(netpoll_fd);
+}
+
+// make the coroutines of the ready fds runnable on p_current, timeout is in ms as for epoll_wait,
+// return the number of coroutines made runnable
+static int netpoll(struct p *p_current, int timeout) {
+    struct epoll_event events[NETPOLL_EVENTS];
+    int n = epoll_wait(netpoll_fd, events, NETPOLL_EVENTS, timeout);
+    int ready = 0;
+    for (int i = 0; i < n; i++) {
+        struct poll_desc *pd = events[i].data.ptr;
+        if ((uintptr_t) pd & NETPOLL_URING) { // completions, the eventfd counter is never read, every write is an edge
+            ready += uring_reap((struct uring *) ((uintptr_t) pd & ~NETPOLL_URING), p_current);
+            continue;
+        }
+        if (!pd) { // interrupted by netpoll_break, left to the blocking poll it was meant for
+            if (timeout == 0) continue;
+            uint64_t value;
+            if (read(netpoll_break_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                panic("read eventfd failed");
+            }
+            atomic_store_explicit(&netpoll_break_pending, 0, memory_order_seq_cst);
+            continue;
+        }
+        uint32_t flags = events[i].events;
+        struct g *rg = NULL, *wg = NULL;
+        if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) rg = netpoll_unblock(&pd->rg, 1);
+        if (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) wg = netpoll_unblock(&pd->wg, 1);
+        if (rg) {
+            netpoll_ready(p_current, rg);
+            ready++;
+        }
+        if (wg) {
+            netpoll_ready(p_current, wg);
+            ready++;
+        }
+    }
+    if (ready > 1) m_wakeup(); // the caller runs one of them itself
+    return ready;
+}
+
+// interrupt an M blocked in netpoll
+static void netpoll_break() {
+    if (atomic_exchange_explicit(&netpoll_break_pending, 1, memory_order_seq_cst)) return;
+    uint64_t one = 1;
+    if (write(netpoll_break_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        panic("write eventfd failed");
+    }
+}
+
+// poll descriptors are never freed before exit, an epoll event racing with co_close still finds valid memory
+static struct poll_desc *poll_desc_get(int fd) {
+    if (fd < 0 || (uint) fd / POLL_DESC_CHUNK >= poll_desc_chunk_num) return NULL;
+    _Atomic(struct poll_desc *) *slot = &poll_desc_chunks[fd / POLL_DESC_CHUNK];
+    struct poll_desc *chunk = atomic_load_explicit(slot, memory_order_acquire);
+    if (!chunk) {
+        struct poll_desc *fresh = calloc(POLL_DESC_CHUNK, sizeof(struct poll_desc));
+        if (!fresh) {
+            panic("malloc poll descriptors failed");
+            return NULL;
+        }
+        for (int i = 0; i < POLL_DESC_CHUNK; i++) {
+            fresh[i].fd = fd / POLL_DESC_CHUNK * POLL_DESC_CHUNK + i;
+            pthread_mutex_init(&fresh[i].mutex, NULL);
+        }
+        if (atomic_compare_exchange_strong_explicit(slot, &chunk, fresh,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            chunk = fresh;
+        } else {
+            free(fresh); // another coroutine got there first, chunk is theirs now
+        }
+    }
+    return &chunk[fd % POLL_DESC_CHUNK];
+}
+
+// register fd with the netpoller on its first use and make it non-blocking,
+// return NULL with errno set on failure, EPERM means fd cannot be polled and blocking calls should be used
+static struct poll_desc *netpoll_open(int fd) {
+    struct poll_desc *pd = poll_desc_get(fd);
+    if (!pd) {
+        errno_set(EBADF);
+        return NULL;
+    }
+    int registered = atomic_load_explicit(&pd->registered, memory_order_acquire);
+    if (registered == 0) {
+        pthread_mutex_lock(&pd->mutex);
+        registered = atomic_load_explicit(&pd->registered, memory_order_relaxed);
+        if (registered == 0) {
+            atomic_store_explicit(&pd->rg, 0, memory_order_relaxed);
+            atomic_store_explicit(&pd->wg, 0, memory_order_relaxed);
+            struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = pd};
+            int flags;
+            if (epoll_ctl(netpoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+                registered = 1;
+                if ((flags = fcntl(fd, F_GETFL)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+                    epoll_ctl(netpoll_fd, EPOLL_CTL_DEL, fd, NULL);
+                    registered = 0;
+                }
+            } else if (errno_get() == EPERM) {
+                registered = -1;
+            }
+            atomic_store_explicit(&pd->registered, registered, memory_order_release);
+        }
+        pthread_mutex_unlock(&pd->mutex);
+    }
+    if (registered < 0) errno_set(EPERM);
+    return registered > 0 ? pd : NULL;
+}
+
+// park the current coroutine until fd is ready for the event of gpp (&pd->rg or &pd->wg),
+// return 0 once it may be ready (the caller retries its syscall), -1 once fd has been closed since seq
+static int netpoll_wait(struct poll_desc *pd, atomic_uintptr_t *gpp, uint seq) {
+    struct g *g_current = g_get_current();
+    while (1) {
+        if (atomic_load_explicit(&pd->seq, memory_order_acquire) != seq) return -1;
+        uintptr_t expected = PD_READY;
+        if (atomic_compare_exchange_strong_explicit(gpp, &expected, 0,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            return 0;
+        }
+        if (expected == 0 && atomic_compare_exchange_strong_explicit(gpp, &expected, PD_WAIT,
+                                                                     memory_order_acq_rel, memory_order_acquire)) {
+            break;
+        }
+        if (expected != 0 && expected != PD_READY) {
+            panic("two coroutines wait for the same event of an fd");
+            return -1;
+        }
+    }
+    struct m *m_current = g_current->m;
+    m_current->p->blocked_poll = gpp;
+    co_context_switch(&g_current->co->context, &m_current->g0->co->context, CO_NET_WAIT); // jump to scheduler
+    atomic_store_explicit(gpp, 0, memory_order_release); // consume the readiness that woke us up
+    return atomic_load_explicit(&pd->seq, memory_order_acquire) == seq ? 0 : -1;
+}
+
+// take the coroutine waiting on gpp, ioready == 0 only wakes it up (fd closed) without leaving readiness
+static struct g *netpoll_unblock(atomic_uintptr_t *gpp, int ioready) {
+    uintptr_t old = atomic_load_explicit(gpp, memory_order_acquire);
+    while (1) {
+        if (old == PD_READY) return NULL;
+        if (old == 0 && !ioready) return NULL;
+        uintptr_t new = ioready ? PD_READY : 0;
+        if (atomic_compare_exchange_weak_explicit(gpp, &old, new, memory_order_acq_rel, memory_order_acquire)) {
+            // a coroutine still committing its park sees the change and runs again, see CO_NET_WAIT
+            if (old == PD_WAIT) return NULL;
+            return (struct g *) old;
+        }
+    }
+}
+
+static void netpoll_ready(struct p *p_current, struct g *g) {
+    atomic_fetch_sub_explicit(&netpoll_waiters, 1, memory_order_relaxed);
+    struct co *co = g->co;
+    pthread_mutex_lock(&co->status_mutex);
+    if (co->status != CO_WAITING) {
+        pthread_mutex_unlock(&co->status_mutex);
+        panic("netpoll waiter status is not CO_WAITING");
+        return;
+    }
+    co->status = CO_RUNNING;
+    pthread_mutex_unlock(&co->status_mutex);
+    p_running_push(p_current, g);
+}
+
+// the io_uring of m_current, NULL if file I/O goes to the thread pool
+static struct uring *uring_get(struct m *m_current) {
+    if (!m_current->uring && !atomic_load_explicit(&uring_disabled, memory_order_relaxed)) {
+        m_current->uring = uring_create();
+        // the same on every M, stop trying
+        if (!m_current->uring) atomic_store_explicit(&uring_disabled, 1, memory_order_relaxed);
+    }
+    return m_current->uring;
+}
+
+// set up a ring, NULL if the kernel lacks io_uring or the features used here
+static struct uring *uring_create() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd < 0) return NULL;
+    // FAST_POLL (5.7) also implies IORING_OP_READ / IORING_OP_WRITE
+    uint required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL;
+    if ((params.features & required) != required) {
+        close(fd);
+        return NULL;
+    }
+    struct uring *ring = calloc(1, sizeof(struct uring));
+    if (!ring) {
+        panic("malloc struct uring failed");
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->ring_size = MAX(params.sq_off.array + params.sq_entries * sizeof(uint),
+                          params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        panic("mmap io_uring failed");
+        return NULL;
+    }
+    uint8_t *base = ring->ring;
+    ring->sq_head = (atomic_uint *) (base + params.sq_off.head);
+    ring->sq_tail = (atomic_uint *) (base + params.sq_off.tail);
+    ring->sq_array = (uint *) (base + params.sq_off.array);
+    ring->sq_mask = *(uint *) (base + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (atomic_uint *) (base + params.cq_off.head);
+    ring->cq_tail = (atomic_uint *) (base + params.cq_off.tail);
+    ring->cq_mask = *(uint *) (base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (base + params.cq_off.cqes);
+    pthread_mutex_init(&ring->cq_mutex, NULL);
+    atomic_init(&ring->inflight, 0);
+    // completions show up in the netpoller, so a parked or polling M picks them up
+    ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->event_fd < 0
+        || syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &ring->event_fd, 1) != 0) {
+        panic("register io_uring eventfd failed");
+        return NULL;
+    }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.ptr = (void *) ((uintptr_t) ring | NETPOLL_URING)};
+    if (epoll_ctl(netpoll_fd, EPOLL_CTL_ADD, ring->event_fd, &ev) != 0) {
+        panic("register io_uring eventfd with epoll failed");
+        return NULL;
+    }
+    return ring;
+}
+
+static void uring_destroy(struct uring *ring) {
+    munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    munmap(ring->ring, ring->ring_size);
+    close(ring->event_fd);
+    close(ring->fd);
+    pthread_mutex_destroy(&ring->cq_mutex);
+    free(ring);
+}
+
+// stage the file I/O of g, return 0 if the submission queue is full even after submitting
+static int uring_prep(struct uring *ring, struct g *g) {
+    uint tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) == ring->sq_entries) {
+        uring_submit(ring);
+        if (tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) == ring->sq_entries) return 0;
+    }
+    struct co_io *io = &g->co->io;
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = io->op == CO_IO_READ ? IORING_OP_READ : io->op == CO_IO_WRITE ? IORING_OP_WRITE : IORING_OP_FSYNC;
+    sqe->fd = io->fd;
+    sqe->addr = (uintptr_t) io->buf;
+    sqe->len = (uint) MIN(io->count, (size_t) UINT32_MAX);
+    sqe->off = (uint64_t) io->offset;
+    sqe->user_data = (uintptr_t) g;
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+    ring->to_submit++;
+    return 1;
+}
+
+// enter everything staged so far with a single io_uring_enter
+static void uring_submit(struct uring *ring) {
+    while (ring->to_submit > 0) {
+        long n = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 0, 0, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EBUSY) return; // short of resources, retry next round
+            panic("io_uring_enter failed");
+            return;
+        }
+        ring->to_submit -= (uint) n;
+    }
+}
+
+// make the coroutines of the completed operations runnable on p_current, return how many
+static int uring_reap(struct uring *ring, struct p *p_current) {
+    // whoever holds the lock reaps, completions arriving after it read the tail signal the eventfd again
+    if (pthread_mutex_trylock(&ring->cq_mutex) != 0) return 0;
+    uint head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    uint tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+    int ready = 0;
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        struct g *g = (struct g *) (uintptr_t) cqe->user_data;
+        g->co->io.res = cqe->res;
+        atomic_fetch_sub_explicit(&ring->inflight, 1, memory_order_relaxed);
+        netpoll_ready(p_current, g);
+        ready++;
+    }
+    atomic_store_explicit(ring->cq_head, head, memory_order_release);
+    pthread_mutex_unlock(&ring->cq_mutex);
+    return ready;
+}
+
+// run a file operation synchronously, return -errno on failure
+static ssize_t io_perform(struct co_io *io) {
+    ssize_t res;
+    do {
+        if (io->op == CO_IO_READ) res = pread(io->fd, io->buf, io->count, io->offset);
+        else if (io->op == CO_IO_WRITE) res = pwrite(io->fd, io->buf, io->count, io->offset);
+        else res = fsync(io->fd);
+    } while (res < 0 && errno == EINTR);
+    return res < 0 ? -errno : res;
+}
+
+static void io_pool_push(struct g *g) {
+    pthread_mutex_lock(&io_pool_mutex);
+    if (!io_pool_started) {
+        list_init(&io_pool_queue);
+        for (int i = 0; i < IO_POOL_THREADS; i++) {
+            thread_create(&io_pool_threads[i], -1, io_pool_run, NULL);
+        }
+        io_pool_started = 1;
+    }
+    list_push_back(&io_pool_queue, &g->link);
+    pthread_cond_signal(&io_pool_cond);
+    pthread_mutex_unlock(&io_pool_mutex);
+}
+
+// a pool thread has no P, it hands finished coroutines to the global queue (or the P they are pinned to)
+static void *io_pool_run(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&io_pool_mutex);
+    while (!atomic_load_explicit(&exit_signal, memory_order_acquire)) {
+        if (list_is_empty(&io_pool_queue)) {
+            pthread_cond_wait(&io_pool_cond, &io_pool_mutex);
+            continue;
+        }
+        struct g *g = list_entry(list_pop_front(&io_pool_queue), struct g, link);
+        pthread_mutex_unlock(&io_pool_mutex);
+        struct co *co = g->co;
+        co->io.res = io_perform(&co->io);
+        pthread_mutex_lock(&co->status_mutex);
+        co->status = CO_RUNNING;
+        pthread_mutex_unlock(&co->status_mutex);
+        if (g->pinned) {
+            p_running_push(NULL, g);
+        } else { // back to the node it last ran on
+            struct mutex_queue *gq = &node_queues[co->io.node];
+            struct list *gq_inner = mq_get(gq);
+            list_push_back(gq_inner, &g->link);
+            atomic_fetch_add_explicit(&global_queue_size, 1, memory_order_seq_cst);
+            mq_free(gq);
+        }
+        m_wakeup();
+        pthread_mutex_lock(&io_pool_mutex);
+    }
+    pthread_mutex_unlock(&io_pool_mutex);
+    return NULL;
+}
+
+static void io_pool_stop() {
+    pthread_mutex_lock(&io_pool_mutex);
+    pthread_cond_broadcast(&io_pool_cond);
+    int started = io_pool_started;
+    pthread_mutex_unlock(&io_pool_mutex);
+    if (!started) return;
+    for (int i = 0; i < IO_POOL_THREADS; i++) {
+        pthread_join(io_pool_threads[i], NULL);
+    }
+}
+
+// the first preemptible coroutine installs the handler and starts the monitor
+static void preempt_start() {
+    if (atomic_load_explicit(&preempt_started, memory_order_acquire)) return;
+    pthread_mutex_lock(&preempt_mutex);
+    if (!atomic_load_explicit(&preempt_started, memory_order_relaxed)) {
+        dl_iterate_phdr(preempt_find_text, NULL);
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = preempt_handler;
+        // not deferred, the handler may switch away and the signal mask would stay with the M
+        action.sa_flags = SA_SIGINFO | SA_RESTART | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(PREEMPT_SIGNAL, &action, NULL) != 0) {
+            pthread_mutex_unlock(&preempt_mutex);
+            panic("install preemption signal handler failed");
+            return;
+        }
+        thread_create(&preempt_thread, -1, preempt_monitor, NULL);
+        atomic_store_explicit(&preempt_started, 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&preempt_mutex);
+}
+
+// remember the code of libco, libc (or whatever provides malloc), the dynamic loader and the vDSO,
+// they may hold locks or be halfway through switching coroutines, the scheduler calls into the vDSO for co_now
+static int preempt_find_text(struct dl_phdr_info *info, size_t size, void *data) {
+    (void) size;
+    (void) data;
+    struct text_range text = {UINTPTR_MAX, 0};
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X)) continue;
+        text.start = MIN(text.start, info->dlpi_addr + phdr->p_vaddr);
+        text.end = MAX(text.end, info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz);
+    }
+    uintptr_t libco = (uintptr_t) co_yield, libc = (uintptr_t) malloc;
+    if (libco >= text.start && libco < text.end) preempt_unsafe[0] = text;
+    if (libc >= text.start && libc < text.end) preempt_unsafe[1] = text;
+    if (info->dlpi_addr == getauxval(AT_BASE)) preempt_unsafe[2] = text;
+    uintptr_t vdso = getauxval(AT_SYSINFO_EHDR); // its program headers follow the ELF header
+    if (vdso && (uintptr_t) info->dlpi_phdr - vdso < page_size) preempt_unsafe[3] = text;
+    return 0;
+}
+
+// runs on the stack of the interrupted coroutine, the full register state is saved in the signal frame below
+// and restored when the coroutine, resumed by some M later, returns from here
+static void preempt_handler(int sig, siginfo_t *info, void *ucontext) {
+    (void) sig;
+    (void) info;
+#if __x86_64__
+    uintptr_t pc = (uintptr_t) ((ucontext_t *) ucontext)->uc_mcontext.gregs[REG_RIP];
+    uintptr_t sp = (uintptr_t) ((ucontext_t *) ucontext)->uc_mcontext.gregs[REG_RSP];
+#else
+    uintptr_t pc = (uintptr_t) ((ucontext_t *) ucontext)->uc_mcontext.gregs[REG_EIP];
+    uintptr_t sp = (uintptr_t) ((ucontext_t *) ucontext)->uc_mcontext.gregs[REG_ESP];
+#endif
+    // outside of these the M runs user code of its current coroutine, so the TLS and g are consistent
+    for (size_t i = 0; i < sizeof(preempt_unsafe) / sizeof(preempt_unsafe[0]); i++) {
+        if (pc >= preempt_unsafe[i].start && pc < preempt_unsafe[i].end) return; // the monitor tries again
+    }
+    struct g *g_current = g_get_current();
+    if (!g_current || !g_current->co->preemptible) return;
+    // a late signal may hit the scheduler on g0 after it set the next coroutine current but before switching,
+    // only switch away from code running on the coroutine's own stack
+    struct co *co = g_current->co;
+    if (!co->stack || sp < (uintptr_t) co->stack || sp >= (uintptr_t) co->stack + co->stack_size) return;
+    int saved_errno = errno_get();
+    co_context_switch(&co->context, &g_current->m->g0->co->context, CO_YIELD);
+    errno_set(saved_errno);
+}
+
+// signal the Ms whose preemptible coroutine has run for a whole time slice, every half a slice
+static void *preempt_monitor(void *arg) {
+    (void) arg;
+    struct timespec period = {(time_t) (time_slice / 2 / 1000000000), (long) (time_slice / 2 % 1000000000)};
+    while (!atomic_load_explicit(&exit_signal, memory_order_acquire)) {
+        nanosleep(&period, NULL);
+        uint64_t now = co_now();
+        for (uint i = 0; i < m_num; i++) {
+            uint64_t start = atomic_load_explicit(&m_set[i].slice_start, memory_order_relaxed);
+            if (start && start + time_slice <= now) pthread_kill(m_set[i].thread_id, PREEMPT_SIGNAL);
+        }
+    }
+    return NULL;
+}
+
+static void preempt_stop() {
+    if (!atomic_load_explicit(&preempt_started, memory_order_acquire)) return;
+    pthread_join(preempt_thread, NULL);
+}
+
+uint64_t co_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static void timer_wheel_init(struct timer_wheel *wheel) {
+    pthread_mutex_init(&wheel->mutex, NULL);
+    wheel->tick = co_now() / TIMER_TICK_NS;
+    for (int l = 0; l < TIMER_LEVELS; l++) {
+        for (int s = 0; s < TIMER_SLOTS; s++) {
+            list_init(&wheel->slots[l][s]);
+        }
+        wheel->occupied[l] = 0;
+    }
+    wheel->count = 0;
+    atomic_init(&wheel->next_when, TIMER_NONE);
+}
+
+// put timer into the slot of its deadline relative to wheel->tick, the caller holds the wheel lock
+static void timer_wheel_insert(struct timer_wheel *wheel, struct timer *timer) {
+    uint64_t expire = (timer->when + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+    if (expire <= wheel->tick) expire = wheel->tick + 1; // already due, fire on the next tick
+    uint64_t delta = expire - wheel->tick;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >> (TIMER_SLOT_BITS * (level + 1))) level++;
+    if (delta >> (TIMER_SLOT_BITS * TIMER_LEVELS)) { // beyond the wheel, park it in the farthest slot for now
+        expire = wheel->tick + ((uint64_t) 1 << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+    }
+    int slot = (int) (expire >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+    timer->expire = expire;
+    timer->level = level;
+    timer->slot = slot;
+    list_push_back(&wheel->slots[level][slot], &timer->link);
+    wheel->occupied[level] |= (uint64_t) 1 << slot;
+}
+
+// the first tick at which timers fire or cascade, only a lower bound for timers on the upper levels
+static uint64_t timer_wheel_next_tick(struct timer_wheel *wheel) {
+    uint64_t next = UINT64_MAX;
+    for (int l = 0; l < TIMER_LEVELS; l++) {
+        if (!wheel->occupied[l]) continue;
+        int shift = TIMER_SLOT_BITS * l;
+        uint current = (uint) (wheel->tick >> shift) & (TIMER_SLOTS - 1);
+        // distance in slots from the current one, the current slot itself comes around last
+        uint rotate = (current + 1) & (TIMER_SLOTS - 1);
+        uint64_t bits = wheel->occupied[l];
+        bits = rotate ? (bits >> rotate) | (bits << (TIMER_SLOTS - rotate)) : bits;
+        uint64_t distance = (uint64_t) __builtin_ctzll(bits) + 1;
+        next = MIN(next, ((wheel->tick >> shift) + distance) << shift);
+    }
+    return next;
+}
+
+static void timer_expire(struct timer_wheel *wheel, struct timer *timer, struct list *expired) {
+    atomic_store_explicit(&timer->firing, 1, memory_order_relaxed);
+    atomic_store_explicit(&timer->p, NULL, memory_order_release); // firing is visible once p reads NULL
+    wheel->count--;
+    list_push_back(expired, &timer->link);
+}
+
+// move the wheel to tick, cascading the upper levels on their boundaries, and collect what expires at it
+static void timer_wheel_advance(struct timer_wheel *wheel, uint64_t tick, struct list *expired) {
+    wheel->tick = tick;
+    for (int l = TIMER_LEVELS - 1; l > 0; l--) {
+        int shift = TIMER_SLOT_BITS * l;
+        if (tick & (((uint64_t) 1 << shift) - 1)) continue;
+        int slot = (int) (tick >> shift) & (TIMER_SLOTS - 1);
+        struct list *list = &wheel->slots[l][slot];
+        wheel->occupied[l] &= ~((uint64_t) 1 << slot);
+        // relative to tick the timers of this slot fall to lower levels, none comes back here
+        while (!list_is_empty(list)) {
+            struct timer *timer = list_entry(list_pop_front(list), struct timer, link);
+            if ((timer->when + TIMER_TICK_NS - 1) / TIMER_TICK_NS <= tick) {
+                timer_expire(wheel, timer, expired);
+            } else {
+                timer_wheel_insert(wheel, timer);
+            }
+        }
+    }
+    int slot = (int) tick & (TIMER_SLOTS - 1);
+    struct list *list = &wheel->slots[0][slot];
+    wheel->occupied[0] &= ~((uint64_t) 1 << slot);
+    while (!list_is_empty(list)) {
+        timer_expire(wheel, list_entry(list_pop_front(list), struct timer, link), expired);
+    }
+}
+
+static void timer_add(struct p *p, struct timer *timer) {
+    struct timer_wheel *wheel = &p->timers;
+    pthread_mutex_lock(&wheel->mutex);
+    atomic_store_explicit(&timer->firing, 0, memory_order_relaxed);
+    atomic_store_explicit(&timer->p, p, memory_order_relaxed);
+    timer_wheel_insert(wheel, timer);
+    wheel->count++;
+    uint64_t when = timer->expire * TIMER_TICK_NS;
+    if (when < atomic_load_explicit(&wheel->next_when, memory_order_relaxed)) {
+        atomic_store_explicit(&wheel->next_when, when, memory_order_seq_cst);
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+    // the M blocked in netpoll sleeps until a later deadline, let it recompute
+    if (atomic_load_explicit(&netpoll_blocked, memory_order_seq_cst)
+        && when < atomic_load_explicit(&netpoll_until, memory_order_seq_cst)) {
+        netpoll_break();
+    }
+}
+
+// take timer off its wheel, or wait for its callback if it is firing already (like del_timer_sync),
+// return 1 if it was still pending; the caller must not hold a lock the callback takes
+static int timer_del(struct timer *timer) {
+    while (1) {
+        struct p *p = atomic_load_explicit(&timer->p, memory_order_acquire);
+        if (p) {
+            struct timer_wheel *wheel = &p->timers;
+            pthread_mutex_lock(&wheel->mutex);
+            if (atomic_load_explicit(&timer->p, memory_order_relaxed) != p) { // fired in the meantime
+                pthread_mutex_unlock(&wheel->mutex);
+                continue;
+            }
+            struct list *list = &wheel->slots[timer->level][timer->slot];
+            list_erase(list, &timer->link);
+            if (list_is_empty(list)) wheel->occupied[timer->level] &= ~((uint64_t) 1 << timer->slot);
+            atomic_store_explicit(&timer->p, NULL, memory_order_relaxed);
+            // next_when stays a lower bound, the next timers_run recomputes it
+            if (--wheel->count == 0) atomic_store_explicit(&wheel->next_when, TIMER_NONE, memory_order_seq_cst);
+            pthread_mutex_unlock(&wheel->mutex);
+            return 1;
+        }
+        if (!atomic_load_explicit(&timer->firing, memory_order_acquire)) return 0;
+        sched_yield(); // the callback is short, it only takes one lock
+    }
+}
+
+// the callback is done with timer, timer_del may return
+static void timer_fired(struct timer *timer) {
+    atomic_store_explicit(&timer->firing, 0, memory_order_release);
+}
+
+// fire the timers of p that expired by now, their callbacks run on p_current, return how many fired
+static int timers_run(struct p *p, struct p *p_current, uint64_t now) {
+    struct timer_wheel *wheel = &p->timers;
+    if (atomic_load_explicit(&wheel->next_when, memory_order_acquire) > now) return 0;
+    struct list expired;
+    list_init(&expired);
+    pthread_mutex_lock(&wheel->mutex);
+    uint64_t now_tick = now / TIMER_TICK_NS;
+    while (wheel->count > 0) {
+        uint64_t tick = timer_wheel_next_tick(wheel);
+        if (tick > now_tick) break;
+        timer_wheel_advance(wheel, tick, &expired);
+    }
+    wheel->tick = MAX(wheel->tick, now_tick); // nothing sits in the skipped slots
+    atomic_store_explicit(&wheel->next_when,
+                          wheel->count ? timer_wheel_next_tick(wheel) * TIMER_TICK_NS : TIMER_NONE,
+                          memory_order_seq_cst);
+    pthread_mutex_unlock(&wheel->mutex);
+    int fired = 0;
+    while (!list_is_empty(&expired)) {
+        struct timer *timer = list_entry(list_pop_front(&expired), struct timer, link);
+        timer->func(timer, p_current);
+        fired++;
+    }
+    if (fired > 1) m_wakeup(); // the caller runs one of the woken coroutines itself
+    return fired;
+}
+
+// fire the expired timers of every P onto p_current
+static int timers_run_all(struct p *p_current) {
+    uint64_t now = 0;
+    int fired = 0;
+    for (uint i = 0; i < m_num; i++) {
+        if (atomic_load_explicit(&p_set[i].timers.next_when, memory_order_relaxed) == TIMER_NONE) continue;
+        if (!now) now = co_now();
+        fired += timers_run(&p_set[i], p_current, now);
+    }
+    return fired;
+}
+
+// the nearest deadline over all Ps
+static uint64_t timers_next() {
+    uint64_t next = TIMER_NONE;
+    for (uint i = 0; i < m_num; i++) {
+        next = MIN(next, atomic_load_explicit(&p_set[i].timers.next_when, memory_order_seq_cst));
+    }
+    return next;
+}
+
+static void sleep_wake(struct timer *timer, struct p *p_current) {
+    struct g *g = list_entry(timer, struct g, timer);
+    struct co *co = g->co;
+    timer_fired(timer);
+    pthread_mutex_lock(&co->status_mutex);
+    co->status = CO_RUNNING;
+    pthread_mutex_unlock(&co->status_mutex);
+    p_running_push(p_current, g);
+}
+
+// the deadline of a timed wait passed, take g off its waiters list unless a waker took it first
+static void timeout_wake(struct timer *timer, struct p *p_current) {
+    struct g *g = list_entry(timer, struct g, timer);
+    pthread_mutex_lock(g->wait_lock);
+    int taken = g->wait_list != NULL;
+    if (taken) {
+        list_erase(g->wait_list, &g->link);
+        g->wait_list = NULL;
+        g->wait_result = -1;
+    }
+    pthread_mutex_unlock(g->wait_lock);
+    timer_fired(timer); // a waker blocked in timer_del finds g taken by itself
+    if (!taken) return; // the waker makes g runnable
+    struct co *co = g->co;
+    pthread_mutex_lock(&co->status_mutex);
+    co->status = CO_RUNNING;
+    pthread_mutex_unlock(&co->status_mutex);
+    p_running_push(p_current, g);
+}
+
+// make a waiter runnable, the caller has set g->wait_list to NULL under g->wait_lock and released that lock
+static void g_wake(struct p *p_current, struct g *g) {
+    struct co *co = g->co;
+    if (g->wait_timed) timer_del(&g->timer); // a firing timeout_wake leaves g to us
+    pthread_mutex_lock(&co->status_mutex);
+    if (co->status != CO_WAITING) {
+        pthread_mutex_unlock(&co->status_mutex);
+        panic("waiter status is not CO_WAITING");
+    }
+    co->status = CO_RUNNING;
+    pthread_mutex_unlock(&co->status_mutex);
+    p_running_push(p_current, g);
+    m_wakeup();
+}
+
+// park g in list, whose lock the caller holds and which is released once g is suspended, until a waker
+// sets g->wait_list to NULL under the lock and calls g_wake, or until deadline unless it is TIMER_NONE;
+// return 0 if woken up, -1 on timeout
+static int g_park(struct g *g, struct list *list, pthread_mutex_t *lock, uint64_t deadline) {
+    list_push_back(list, &g->link);
+    g->wait_list = list;
+    g->wait_lock = lock;
+    g->wait_timed = deadline != TIMER_NONE;
+    g->wait_result = 0;
+    g->timer.when = deadline;
+    g->timer.func = timeout_wake;
+    g->m->p->blocked_lock = lock;
+    co_context_switch(&g->co->context, &g->m->g0->co->context, CO_PARK); // jump to scheduler
+    return g->wait_result;
+}
+
+// spin a little on a contended lock instead of parking at once, as long as another M may release it
+// and the P of g has nothing else to run
+static int lock_spin(struct g *g, int iter) {
+    if (iter >= LOCK_SPIN_ROUNDS || m_num < 2 || !p_runq_empty(g->m->p)) return 0;
+    for (int i = 0; i < LOCK_SPIN_PAUSES; i++) {
+        __builtin_ia32_pause();
+    }
+    return 1;
+}
+
+// a coroutine may resume on another M, so like errno (see errno_get) the TLS is read by calls
+// the compiler cannot look into, it could otherwise reuse the address of tls_current taken before a switch
+__attribute__((noipa))
+static struct g *g_get_current() {
+    return tls_current.g;
+}
+
+__attribute__((noipa))
+static struct m *m_get_current() {
+    return tls_current.m;
+}
+
+static void *m_run_coroutine(void *ptr) {
+    struct g *g0 = (struct g *) ptr;
+    // init TLS data
+    tls_current.g = g0;
+    tls_current.m = g0->m;
+    m_schedule(g0, CO_SCHEDULE);
+    return NULL;
+}
+
+// g0 of main's M runs on a stack of its own, co_init_ex enters it once by yielding from main
+static void m_main_g0(void *arg) {
+    m_schedule((struct g *) arg, CO_YIELD);
+    panic("the scheduler of main's M returned");
+}
+
+// the scheduler loop of g0's M, entered as if the current coroutine had just trapped into it with val
+static void m_schedule(struct g *g0, int val) {
+    // g0 never leaves its M, so the address of tls_current may be kept
+    struct tls_block *tls = &tls_current;
+    // current m, p
+    struct m *m_current = g0->m;
+    struct p *p_current = m_current->p;
+    // schedule
+    while (!atomic_load_explicit(&exit_signal, memory_order_acquire)) {
+        if (val == CO_SCHEDULE) { // run next
+            struct g *g_next = m_find_runnable(m_current, p_current);
+            if (g_next) {
+                m_reset_spinning(m_current);
+                g_next->m = m_current;
+                tls->g = g_next;
+                struct co *co_current = g_next->co;
+                if (co_current->status != CO_NEW && co_current->status != CO_RUNNING) {
+//                    printf("coroutine status: %d\n", co_current->status);
+                    panic("invalid coroutine status");
+                }
+                if (co_current->shared) {
+                    shared_stack_restore(m_current, co_current);
+                }
+                if (co_current->preemptible) {
+                    atomic_store_explicit(&m_current->slice_start, co_now(), memory_order_relaxed);
+                }
+                // a new coroutine starts from co_wrapper, see co_new
+                val = (int) co_context_switch(&g0->co->context, &co_current->context, 0);
+                atomic_store_explicit(&m_current->slice_start, 0, memory_order_relaxed);
+            }
+        } else if (val == CO_YIELD) { // suspend
+//            printf("suspend coroutine\n");
+            struct g *g_current = tls->g;
+            p_running_push(p_current, g_current);
+            tls->g = g0;
+            val = CO_SCHEDULE;
+        } else if (val == CO_EXIT) { // exit
+            struct g *g_current = tls->g;
+            struct co *co = g_current->co;
+            // recycle stack
+            if (co->shared) {
+                if (m_current->shared_owner == co) m_current->shared_owner = NULL;
+                free(co->save_buf);
+                co->save_buf = NULL;
+            } else {
+                stack_free(p_current, co->stack, co->stack_size);
+            }
+            co->stack = NULL;
+            // set status to CO_DEAD and wake up all waiters
+            pthread_mutex_lock(&co->status_mutex);
+            co->status = CO_DEAD;
+            struct list woken; // taken off under the lock, woken up outside it where timer_del may wait
+            list_init(&woken);
+            while (!list_is_empty(&co->waiters)) {
+                struct g *waiter = list_entry(list_pop_front(&co->waiters), struct g, link);
+                waiter->wait_list = NULL;
+                list_push_back(&woken, &waiter->link);
+            }
+            struct list exits;
+            list_init(&exits);
+            while (!list_is_empty(&co->exit_nodes)) {
+                list_push_back(&exits, list_pop_front(&co->exit_nodes));
+            }
+            pthread_mutex_unlock(&co->status_mutex);
+            while (!list_is_empty(&woken)) {
+                g_wake(p_current, list_entry(list_pop_front(&woken), struct g, link));
+            }
+            while (!list_is_empty(&exits)) { // a node goes away with its group once the counter is zero
+                waitgroup_add(p_current, list_entry(list_pop_front(&exits), struct exit_node, link)->wg, -1);
+            }
+            // the runtime lets go of co, it is freed here unless the user still holds its handle
+            co_unref(p_current, co);
+            tls->g = g0;
+            val = CO_SCHEDULE;
+        } else if (val == CO_WAIT) { // wait
+            struct g *g_current = tls->g;
+            struct co *co_current = g_current->co, *to_be_waited = p_current->to_be_waited;
+            // add to waiters
+            pthread_mutex_lock(&to_be_waited->status_mutex);
+            if (to_be_waited->status == CO_DEAD) { // finished in the meantime, nothing to wait for
+                pthread_mutex_unlock(&to_be_waited->status_mutex);
+                p_running_push(p_current, g_current);
+                tls->g = g0;
+                val = CO_SCHEDULE;
+                continue;
+            }
+            list_push_back(&to_be_waited->waiters, &g_current->link);
+            g_current->wait_list = &to_be_waited->waiters;
+            g_current->m = NULL;
+            // set co_current's status to CO_WAITING
+            // do not free to_be_waited mutex here
+            pthread_mutex_lock(&co_current->status_mutex);
+            co_current->status = CO_WAITING;
+            pthread_mutex_unlock(&co_current->status_mutex);
+            if (g_current->wait_timed) timer_add(p_current, &g_current->timer);
+            pthread_mutex_unlock(&to_be_waited->status_mutex);
+            tls->g = g0;
+            val = CO_SCHEDULE;
+        } else if (val == CO_NET_WAIT) { // wait for an fd
+            struct g *g_current = tls->g;
+            struct co *co_current = g_current->co;
+            atomic_uintptr_t *gpp = p_current->blocked_poll;
+            g_current->m = NULL;
+            pthread_mutex_lock(&co_current->status_mutex);
+            co_current->status = CO_WAITING;
+            pthread_mutex_unlock(&co_current->status_mutex);
+            atomic_fetch_add_explicit(&netpoll_waiters, 1, memory_order_seq_cst);
+            uintptr_t expected = PD_WAIT;
+            if (!atomic_compare_exchange_strong_explicit(gpp, &expected, (uintptr_t) g_current,
+                                                         memory_order_acq_rel, memory_order_acquire)) {
+                // became ready or closed before the coroutine was published, run it again
+                netpoll_ready(p_current, g_current);
+            }
+            tls->g = g0;
+            val = CO_SCHEDULE;
+        } else if (val == CO_SLEEP) { // sleep until g->timer expires
+            struct g *g_current = tls->g;
+            struct co *co_current = g_current->co;
+            g_current->m = NULL;
+            pthread_mutex_lock(&co_current->status_mutex);
+            co_current->status = CO_WAITING;
+            pthread_mutex_unlock(&co_current->status_mutex);
+            timer_add(p_current, &g_current->timer);
+            tls->g = g0;
+            val = CO_SCHEDULE;
+        } else if (val == CO_CHAN_WAIT) { // park in co_select
+            struct g *g_current = tls->g;
+            struct co *co_current = g_current->co;
+            struct chan_select *select = p_current->blocked_select;
+            g_current->m = NULL;
+            pthread_mutex_lock(&co_current->status_mutex);
+            co_current->status = CO_WAITING;
+            pthread_mutex_unlock(&co_current->status_mutex);
+            // wakers may claim the waiters from now on
+            chan_unlock_all(select->order, select->nchan);
+            tls->g = g0;
+            val = CO_SCHEDULE;
+        } else if (val == CO_IO_WAIT) { // wait for file I/O
+            struct g *g_current = tls->g;
+            struct co *co_current = g_current->co;
+            struct uring *ring = p_current->blocked_io;
+            g_current->m = NULL;
+            pthread_mutex_lock(&co_current->status_mutex);
+            co_current->status = CO_WAITING;
+            pthread_mutex_unlock(&co_current->status_mutex);
+            if (ring) {
+                // staged only, it is submitted at the end of the round, see m_find_runnable
+                atomic_fetch_add_explicit(&netpoll_waiters, 1, memory_order_seq_cst);
+                atomic_fetch_add_explicit(&ring->inflight, 1, memory_order_relaxed);
+            } else {
+                io_pool_push(g_current);
+            }
+            tls->g = g0;
+            val = CO_SCHEDULE;
+        } else { // park on a semaphore or a lock, see g_park
+            struct g *g_current = tls->g;
+            struct co *co_current = g_current->co;
+            g_current->m = NULL;
+            pthread_mutex_lock(&co_current->status_mutex);
+            co_current->status = CO_WAITING;
+            pthread_mutex_unlock(&co_current->status_mutex);
+            if (g_current->wait_timed) timer_add(p_current, &g_current->timer);
+            pthread_mutex_unlock(p_current->blocked_lock);
+            tls->g = g0;
+            val = CO_SCHEDULE;
+        }
+    }
+}
+
+// copy the used part of the shared stack out, [sp, top) with sp saved by co_context_switch
+static void shared_stack_save(struct co *co) {
+    uint8_t *top = co->stack + co->stack_size;
+    size_t size = top - (uint8_t *) co->context.sp;
+    if (size > co->save_cap) {
+        free(co->save_buf);
+        co->save_buf = (uint8_t *) malloc(size);
+        if (!co->save_buf) {
+            panic("malloc shared stack save buffer failed");
+            return;
+        }
+        co->save_cap = size;
+    }
+    memcpy(co->save_buf, co->context.sp, size);
+    co->save_size = size;
+}
+
+// make the shared stack of m_current hold co's frames, the previous owner is saved lazily,
+// so a coroutine resumed right after its own suspension copies nothing
+static void shared_stack_restore(struct m *m_current, struct co *co) {
+    if (!m_current->shared_stack) {
+        m_current->shared_stack = stack_alloc(NULL, shared_stack_size);
+    }
+    struct co *owner = m_current->shared_owner;
+    if (owner == co) return;
+    if (owner) {
+        shared_stack_save(owner);
+    }
+    m_current->shared_owner = co;
+    if (co->status == CO_NEW) {
+        // pin it, its frames are only valid at the addresses of this M's shared stack
+        co->g->pinned = m_current->p;
+        co->stack = m_current->shared_stack;
+        co->stack_size = shared_stack_size;
+        co_context_make(&co->context, co->stack + co->stack_size, co_wrapper, co);
+        return;
+    }
+    memcpy(co->context.sp, co->save_buf, co->save_size);
+}
+
+static void co_wrapper(struct co *co) {
+    co->status = CO_RUNNING;
+    if (co->value_func) {
+        co->result = co->value_func(co->arg);
+    } else {
+        co->func(co->arg);
+    }
+    co_context_switch(&co->context, &m_get_current()->g0->co->context, CO_EXIT); // exit coroutine
+}
+
+static void co_context_make(co_context *ctx, uint8_t *stack_top, void (*entry)(struct co *), struct co *arg) {
+    // the frame popped by co_context_switch, so that it returns into co_context_entry
+    uintptr_t *sp = (uintptr_t *) ((uintptr_t) stack_top & ~(uintptr_t) 15);
+#if __x86_64__
+    sp -= 8;
+    sp[0] = CO_MXCSR_DEFAULT | ((uintptr_t) CO_FPUCW_DEFAULT << 32);
+    sp[1] = 0;                           // r15
+    sp[2] = 0;                           // r14
+    sp[3] = 0;                           // r13
+    sp[4] = (uintptr_t) entry;           // r12
+    sp[5] = (uintptr_t) arg;             // rbx
+    sp[6] = 0;                           // rbp
+    sp[7] = (uintptr_t) co_context_entry; // return address
+#else
+    sp -= 10;
+    sp[0] = CO_MXCSR_DEFAULT;
+    sp[1] = CO_FPUCW_DEFAULT;
+    sp[2] = 0;                           // edi
+    sp[3] = (uintptr_t) entry;           // esi
+    sp[4] = (uintptr_t) arg;             // ebx
+    sp[5] = 0;                           // ebp
+    sp[6] = (uintptr_t) co_context_entry; // return address, esp is 16-byte aligned after pushing arg
+#endif
+    ctx->sp = sp;
+}
+
+// release the resources held by co, its stack goes to p's cache, the co itself belongs to its g_block
+static void co_free(struct co *co, struct p *p) {
+    if (co->stack && !co->shared) { // the shared stack belongs to the M
+        stack_free(p, co->stack, co->stack_size);
+        co->stack = NULL;
+    }
+    if (co->name && co->name != co->name_inline) {
+        free(co->name);
+    }
+    co->name = NULL;
+    free(co->save_buf);
+    co->save_buf = NULL;
+    list_destroy(&co->waiters);
+    list_destroy(&co->exit_nodes);
+    pthread_mutex_destroy(&co->status_mutex);
+}
+
+// init the co of g, stack == NULL means the coroutine runs on the stack of a thread
+static struct co *co_new(const char *name, void (*func)(void *), void *arg, struct g *g,
+                         uint8_t *stack, size_t stack_size) {
+    if (!name) {
+        panic("name or func is NULL");
+        return NULL;
+    }
+    struct co *co = g->co;
+    size_t name_len = strlen(name);
+    if (name_len < CO_NAME_INLINE) {
+        co->name = co->name_inline;
+    } else {
+        co->name = (char *) malloc(name_len + 1);
+        if (!co->name) {
+            panic("malloc data->name failed");
+            return NULL;
+        }
+    }
+    memcpy(co->name, name, name_len + 1);
+    co->stack = stack;
+    co->stack_size = stack_size;
+    co->func = func;
+    co->value_func = NULL;
+    co->result.u = 0;
+    co->arg = arg;
+    co->status = CO_NEW;
+    atomic_init(&co->refs, 2);
+    co->shared = 0;
+    co->preemptible = 0;
+    co->save_buf = NULL;
+    co->save_size = 0;
+    co->save_cap = 0;
+    if (stack) {
+        co_context_make(&co->context, co->stack + co->stack_size, co_wrapper, co);
+    }
+    list_init(&co->waiters);
+    list_init(&co->exit_nodes);
+    co->status_mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    int result = pthread_mutex_init(&co->status_mutex, NULL);
+    if (result != 0) {
+        co_free(co, NULL);
+        panic("init global queue mutex failed");
+        return NULL;
+    }
+    return co;
+}
+
+struct co *co_start(const char *name, void (*func)(void *), void *arg) {
+    return co_start_attr(name, func, arg, NULL);
+}
+
+struct co *co_start_attr(const char *name, void (*func)(void *), void *arg, const struct co_attr *attr) {
+//    printf("co_start\n");
+    struct p *p_current = m_get_current()->p;
+    struct g *g = co_create(p_current, name, func, arg, attr);
+    // coroutines started by main wait in P0's queue until other Ps steal them
+    p_running_push(p_current, g);
+    m_wakeup();
+    return g->co;
+}
+
+struct co *co_spawn(const char *name, union co_value (*func)(void *), void *arg) {
+    if (!func) {
+        panic("co_spawn func is NULL");
+        return NULL;
+    }
+    struct p *p_current = m_get_current()->p;
+    struct g *g = co_create(p_current, name, NULL, arg, NULL);
+    g->co->value_func = func;
+    p_running_push(p_current, g);
+    m_wakeup();
+    return g->co;
+}
+
+void co_start_batch(const char *name, void (*func)(void *), void **args, size_t n, struct co **cos) {
+    if (n == 0) return;
+    struct p *p_current = m_get_current()->p;
+    for (size_t i = 0; i < n; i++) {
+        cos[i] = co_create(p_current, name, func, args ? args[i] : NULL, NULL)->co;
+    }
+    p_running_push_batch(p_current, cos, n);
+    m_wakeup_many(n);
+}
+
+// allocate and init a new coroutine from p_current's caches, it is not runnable yet
+static struct g *co_create(struct p *p_current, const char *name, void (*func)(void *), void *arg,
+                           const struct co_attr *attr) {
+    if (attr && (uint) attr->priority >= PRIORITY_CLASSES) {
+        panic("invalid coroutine priority");
+        return NULL;
+    }
+    struct g *g = g_alloc(p_current);
+    struct co *co;
+    if (attr && attr->shared_stack) {
+        // the stack of the M that first runs it is bound at that time, see shared_stack_restore
+        co = co_new(name, func, arg, g, NULL, 0);
+        co->shared = 1;
+    } else {
+        size_t stack_size = co_stack_size;
+        if (attr && attr->stack_size) {
+            stack_size = (attr->stack_size + page_size - 1) & ~(page_size - 1);
+        }
+        co = co_new(name, func, arg, g, stack_alloc(p_current, stack_size), stack_size);
+    }
+    if (attr) g->priority = attr->priority;
+    if (attr && attr->preemptible) {
+        co->preemptible = 1;
+        preempt_start();
+    }
+    return g;
+}
+
+void co_yield() {
+//    printf("co_yield\n");
+    struct g *g_current = g_get_current();
+    co_context_switch(&g_current->co->context, &g_current->m->g0->co->context, CO_YIELD); // jump to scheduler
+}
+
+// wait for co to finish, or until deadline unless it is TIMER_NONE, return 0 if it finished, -1 on timeout
+static int co_wait_until(struct co *co, uint64_t deadline) {
+    if (!co || co == co_main) {
+        panic("co is NULL or main coroutine");
+        return 0;
+    }
+    struct g *g_current = g_get_current();
+    struct m *m_current = g_current->m;
+    pthread_mutex_lock(&co->status_mutex);
+    if (co->status == CO_DEAD) {
+        pthread_mutex_unlock(&co->status_mutex);
+        return 0;
+    }
+    if (deadline != TIMER_NONE && deadline <= co_now()) {
+        pthread_mutex_unlock(&co->status_mutex);
+        return -1;
+    }
+    g_current->wait_lock = &co->status_mutex;
+    g_current->wait_timed = deadline != TIMER_NONE;
+    g_current->wait_result = 0;
+    pthread_mutex_unlock(&co->status_mutex);
+    g_current->timer.when = deadline;
+    g_current->timer.func = timeout_wake;
+    m_current->p->to_be_waited = co;
+    co_context_switch(&g_current->co->context, &m_current->g0->co->context, CO_WAIT); // jump to scheduler
+    return g_current->wait_result;
+}
+
+void co_wait(struct co *co) {
+//    printf("co_wait\n");
+    co_wait_until(co, TIMER_NONE);
+}
+
+// the result is written before CO_EXIT wakes the waiters, whose wakeup (or the status check under status_mutex
+// when co has died already) orders the write before the read
+union co_value co_await_result(struct co *co) {
+    if (co && !co->value_func) {
+        panic("co_await_result on a coroutine not started by co_spawn");
+    }
+    co_wait_until(co, TIMER_NONE);
+    return co->result;
+}
+
+int co_wait_timeout(struct co *co, uint64_t deadline) {
+    if (co_wait_until(co, deadline) < 0) {
+        errno_set(ETIMEDOUT);
+        return -1;
+    }
+    return 0;
+}
+
+// CPU limit of the cgroup v2 hierarchy the process lives in, 0 if there is none
+static uint cgroup_cpu_limit() {
+    FILE *fp = fopen("/proc/self/cgroup", "r");
+    if (!fp) return 0;
+    char line[512], path[PATH_MAX];
+    path[0] = '\0';
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(path, sizeof(path), CGROUP_ROOT "%s", line + 3);
+            break;
+        }
+    }
+    fclose(fp);
+    if (path[0] == '\0') return 0;
+    // the tightest quota along the path to the root wins
+    uint limit = 0;
+    size_t root_len = strlen(CGROUP_ROOT);
+    while (strlen(path) >= root_len) {
+        char file[PATH_MAX + 16];
+        snprintf(file, sizeof(file), "%s/cpu.max", path);
+        fp = fopen(file, "r");
+        if (fp) {
+            long long quota, period;
+            if (fscanf(fp, "%lld %lld", &quota, &period) == 2 && quota > 0 && period > 0) {
+                uint cpus = (uint) ((quota + period - 1) / period);
+                if (limit == 0 || cpus < limit) limit = cpus;
+            }
+            fclose(fp);
+        }
+        char *slash = strrchr(path, '/');
+        if (!slash || (size_t) (slash - path) < root_len) break;
+        *slash = '\0';
+    }
+    return limit;
+}
+
+// first CPU of a cpulist file like "0-3,8-11", -1 if there is none
+static int sysfs_first_cpu(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+    int cpu;
+    if (fscanf(fp, "%d", &cpu) != 1) cpu = -1;
+    fclose(fp);
+    return cpu;
+}
+
+static void cpu_topo_read(int cpu, struct cpu_topo *topo) {
+    char path[PATH_MAX];
+    topo->cpu = cpu;
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+    topo->core = sysfs_first_cpu(path);
+    if (topo->core < 0) topo->core = cpu;
+    // the last-level cache is the highest level listed
+    topo->llc = topo->core;
+    int llc_level = 0;
+    for (int index = 0;; index++) {
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/level", cpu, index);
+        int level = sysfs_first_cpu(path);
+        if (level < 0) break;
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+        int first = sysfs_first_cpu(path);
+        if (level > llc_level && first >= 0) {
+            llc_level = level;
+            topo->llc = first;
+        }
+    }
+    // the node shows up as a nodeN link in the directory of the CPU
+    topo->node = 0;
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && sscanf(entry->d_name + 4, "%d", &topo->node) == 1) break;
+    }
+    closedir(dir);
+}
+
+// nodes, then caches, then cores, so that consecutive Ms are close to each other
+static int cpu_topo_cmp(const void *a, const void *b) {
+    const struct cpu_topo *x = a, *y = b;
+    if (x->node != y->node) return x->node - y->node;
+    if (x->llc != y->llc) return x->llc - y->llc;
+    if (x->core != y->core) return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+static uint cpu_topo_level(const struct cpu_topo *a, const struct cpu_topo *b) {
+    if (a->core == b->core) return 0;
+    if (a->llc == b->llc) return 1;
+    if (a->node == b->node) return 2;
+    return 3;
+}
+
+// Ms other than main's are pinned to one allowed CPU each, in topology order, when there are enough CPUs;
+// otherwise nothing is pinned and all Ps count as equally far away on one node
+static void topology_init() {
+    struct cpu_topo *topos = calloc(MAX(m_num, CPU_SETSIZE), sizeof(struct cpu_topo));
+    if (!topos) {
+        panic("malloc cpu topology failed");
+        return;
+    }
+    uint cpus = 0;
+    if (sched_getaffinity(0, sizeof(process_cpus), &process_cpus) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &process_cpus)) cpu_topo_read(cpu, &topos[cpus++]);
+        }
+    } else {
+        CPU_ZERO(&process_cpus);
+    }
+    int pin = !affinity_disabled && cpus >= m_num;
+    if (pin) {
+        qsort(topos, cpus, sizeof(struct cpu_topo), cpu_topo_cmp);
+    } else {
+        for (uint i = 0; i < m_num; i++) {
+            topos[i] = (struct cpu_topo) {.cpu = -1, .core = -1 - (int) i, .llc = -1 - (int) i, .node = 0};
+        }
+    }
+    // main's thread is left unpinned, threads the program starts later keep the affinity of the process
+    node_num = 1;
+    for (uint i = 0; i < m_num; i++) {
+        m_set[i].cpu = i > 0 ? topos[i].cpu : -1;
+        node_num = MAX(node_num, (uint) topos[i].node + 1);
+    }
+    node_queues = calloc(node_num, sizeof(struct mutex_queue));
+    if (!node_queues) {
+        panic("malloc injection queues failed");
+        return;
+    }
+    for (uint i = 0; i < node_num; i++) {
+        mq_init(&node_queues[i]);
+    }
+    for (uint i = 0; i < m_num; i++) {
+        struct p *p = &p_set[i];
+        for (int c = 0; c < PRIORITY_CLASSES; c++) {
+            p->running_queues[c].node = (uint) topos[i].node;
+        }
+        p->steal_order = malloc(sizeof(uint) * (m_num > 1 ? m_num - 1 : 1));
+        if (!p->steal_order) {
+            panic("malloc steal order failed");
+            return;
+        }
+        uint n = 0;
+        for (uint level = 0; level < TOPO_LEVELS; level++) {
+            for (uint j = 0; j < m_num; j++) {
+                if (j != i && cpu_topo_level(&topos[i], &topos[j]) == level) p->steal_order[n++] = j;
+            }
+            p->steal_end[level] = n;
+        }
+    }
+    free(topos);
+}
+
+// pinned to cpu, or with the affinity of the process if cpu is -1
+static void thread_create(pthread_t *thread, int cpu, void *(*start)(void *), void *arg) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    cpu_set_t cpus;
+    if (cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    } else if (CPU_COUNT(&process_cpus) > 0) {
+        pthread_attr_setaffinity_np(&attr, sizeof(process_cpus), &process_cpus);
+    }
+    int result = pthread_create(thread, &attr, start, arg);
+    pthread_attr_destroy(&attr);
+    if (result != 0) {
+        panic("create thread failed");
+    }
+}
+
+static uint default_m_num() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint n = cpus > 0 ? (uint) cpus : 1;
+    uint limit = cgroup_cpu_limit();
+    if (limit > 0 && limit < n) n = limit;
+    return n;
+}
+
+void co_init() {
+    co_init_ex(NULL);
+}
+
+void co_init_ex(const struct co_config *config) {
+    // apply configuration
+    // main's M schedules coroutines too, so by default it takes one of the CPUs
+    m_num = config && config->m_num ? config->m_num : default_m_num();
+    page_size = (size_t) sysconf(_SC_PAGESIZE);
+    if (config && config->stack_size) co_stack_size = config->stack_size;
+    co_stack_size = (co_stack_size + page_size - 1) & ~(page_size - 1);
+    if (config && config->shared_stack_size) shared_stack_size = config->shared_stack_size;
+    shared_stack_size = (shared_stack_size + page_size - 1) & ~(page_size - 1);
+    if (config && config->disable_io_uring) atomic_store_explicit(&uring_disabled, 1, memory_order_relaxed);
+    if (config && config->time_slice) time_slice = config->time_slice;
+    if (config && config->disable_affinity) affinity_disabled = 1;
+    if (config && config->run_queue_size) {
+        run_queue_size = 2;
+        while (run_queue_size < config->run_queue_size) run_queue_size <<= 1;
+    }
+    m_set = calloc(m_num, sizeof(struct m));
+    p_set = calloc(m_num, sizeof(struct p));
+    if (!m_set || !p_set) {
+        panic("malloc m_set or p_set failed");
+        return;
+    }
+    // init depots
+    depot_init(&stack_depot);
+    depot_init(&g_depot);
+    netpoll_init();
+    // main coroutine occupies main thread
+    for (uint i = 0; i < m_num; i++) {
+        p_init(&p_set[i]);
+        m_set[i].g0 = g_alloc(NULL);
+        m_set[i].p = &p_set[i];
+        m_set[i].g0->m = &m_set[i];
+        m_set[i].rand_state = i + 1;
+        m_set[i].spinning = 0;
+        atomic_init(&m_set[i].park_word, 0);
+        atomic_init(&m_set[i].slice_start, 0);
+    }
+    // pin Ms and order their steal victims, set up the injection queues
+    topology_init();
+    // main is a coroutine pinned to P0, whenever it blocks the main thread schedules P0 on a g0 of its own
+    m_set[0].thread_id = pthread_self();
+    struct g *g_main = g_alloc(NULL);
+    g_main->m = &m_set[0];
+    g_main->pinned = &p_set[0];
+    co_main = co_new("co_main", NULL, NULL, g_main, NULL, 0);
+    co_main->status = CO_RUNNING;
+    uint8_t *g0_stack = stack_alloc(NULL, CO_MAIN_G0_STACK_SIZE);
+    co_new("co_run_coroutine", m_main_g0, m_set[0].g0, m_set[0].g0, g0_stack, CO_MAIN_G0_STACK_SIZE);
     // init TLS data of main
-    struct g **tls_data_g_current = malloc(sizeof(struct g *));
-    pthread_setspecific(tls_key_g_current, tls_data_g_current);
-    *tls_data_g_current = co_main->g;
+    tls_current.g = g_main;
+    tls_current.m = &m_set[0];
+    co_yield(); // starts the scheduler of P0, which runs main again at once
     // other coroutines
-    for (int i = 1; i < M_NUM; i++) {
-        m_set[i].g0->co = co_new("co_run_coroutine", NULL, NULL, m_set[i].g0);
-        pthread_create(&m_set[i].thread_id, NULL, m_run_coroutine, m_set[i].g0);
+    for (uint i = 1; i < m_num; i++) {
+        co_new("co_run_coroutine", NULL, NULL, m_set[i].g0, NULL, 0);
+        thread_create(&m_set[i].thread_id, m_set[i].cpu, m_run_coroutine, m_set[i].g0);
+    }
+}
+
+struct co_sem *co_sem_create(uint value) {
+    struct co_sem *sem = (struct co_sem *) malloc(sizeof(struct co_sem));
+    if (!sem) {
+        panic("malloc struct co_sem failed");
+        return NULL;
+    }
+    atomic_init(&sem->state, value * SEM_COUNT);
+    sem->mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    int result = pthread_mutex_init(&sem->mutex, NULL);
+    if (result != 0) {
+        free(sem);
+        panic("init semaphore mutex failed");
+        return NULL;
+    }
+    list_init(&sem->waiters);
+    return sem;
+}
+
+// take sem, waiting until deadline unless it is TIMER_NONE, return 0 once taken, -1 on timeout
+static int co_sem_wait_until(struct co_sem *sem, uint64_t deadline) {
+    uint state = atomic_load_explicit(&sem->state, memory_order_relaxed);
+    while (state >= SEM_COUNT) {
+        if (atomic_compare_exchange_weak_explicit(&sem->state, &state, state - SEM_COUNT,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            return 0;
+        }
+    }
+    if (deadline != TIMER_NONE && deadline <= co_now()) return -1;
+    // with SEM_WAITERS set posts come through the lock, so none is missed between the check and parking
+    pthread_mutex_lock(&sem->mutex);
+    state = atomic_fetch_or_explicit(&sem->state, SEM_WAITERS, memory_order_seq_cst) | SEM_WAITERS;
+    while (state >= SEM_COUNT) { // posted in the meantime
+        uint next = (state - SEM_COUNT) & (list_is_empty(&sem->waiters) ? ~SEM_WAITERS : ~0u);
+        if (atomic_compare_exchange_weak_explicit(&sem->state, &state, next,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            pthread_mutex_unlock(&sem->mutex);
+            return 0;
+        }
+    }
+    return g_park(g_get_current(), &sem->waiters, &sem->mutex, deadline);
+}
+
+void co_sem_wait(struct co_sem *sem) {
+    co_sem_wait_until(sem, TIMER_NONE);
+}
+
+int co_sem_timedwait(struct co_sem *sem, uint64_t deadline) {
+    if (co_sem_wait_until(sem, deadline) < 0) {
+        errno_set(ETIMEDOUT);
+        return -1;
+    }
+    return 0;
+}
+
+void co_sem_post(struct co_sem *sem) {
+    uint state = atomic_load_explicit(&sem->state, memory_order_relaxed);
+    while (!(state & SEM_WAITERS)) {
+        if (atomic_compare_exchange_weak_explicit(&sem->state, &state, state + SEM_COUNT,
+                                                  memory_order_release, memory_order_relaxed)) {
+            return;
+        }
+    }
+    pthread_mutex_lock(&sem->mutex);
+    struct node *node = list_pop_front(&sem->waiters);
+    if (!node) { // the waiters timed out or took a count meanwhile
+        state = atomic_load_explicit(&sem->state, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&sem->state, &state, (state + SEM_COUNT) & ~SEM_WAITERS,
+                                                      memory_order_release, memory_order_relaxed));
+        pthread_mutex_unlock(&sem->mutex);
+        return;
+    }
+    // handed over directly, the count stays
+    if (list_is_empty(&sem->waiters)) atomic_fetch_and_explicit(&sem->state, ~SEM_WAITERS, memory_order_relaxed);
+    struct g *waiter = list_entry(node, struct g, link);
+    waiter->wait_list = NULL;
+    pthread_mutex_unlock(&sem->mutex);
+    g_wake(m_get_current()->p, waiter);
+}
+
+void co_release(struct co *co) {
+    if (!co || co == co_main) {
+        panic("co is NULL or main coroutine");
+        return;
+    }
+    co_unref(m_get_current()->p, co);
+}
+
+void co_detach(struct co *co) {
+    co_release(co);
+}
+
+ssize_t co_read(int fd, void *buf, size_t count) {
+    struct poll_desc *pd = netpoll_open(fd);
+    if (!pd) return errno_get() == EPERM ? read(fd, buf, count) : -1;
+    uint seq = atomic_load_explicit(&pd->seq, memory_order_acquire);
+    while (1) {
+        ssize_t n = read(fd, buf, count);
+        if (n >= 0) return n;
+        if (errno_get() == EINTR) continue;
+        if (errno_get() != EAGAIN) return -1;
+        if (netpoll_wait(pd, &pd->rg, seq) < 0) {
+            errno_set(EBADF);
+            return -1;
+        }
+    }
+}
+
+ssize_t co_write(int fd, const void *buf, size_t count) {
+    struct poll_desc *pd = netpoll_open(fd);
+    if (!pd) return errno_get() == EPERM ? write(fd, buf, count) : -1;
+    uint seq = atomic_load_explicit(&pd->seq, memory_order_acquire);
+    size_t written = 0;
+    while (written < count) {
+        ssize_t n = write(fd, (const char *) buf + written, count - written);
+        if (n >= 0) {
+            written += n;
+            continue;
+        }
+        if (errno_get() == EINTR) continue;
+        if (errno_get() != EAGAIN) return written > 0 ? (ssize_t) written : -1;
+        if (netpoll_wait(pd, &pd->wg, seq) < 0) {
+            errno_set(EBADF);
+            return written > 0 ? (ssize_t) written : -1;
+        }
+    }
+    return (ssize_t) written;
+}
+
+int co_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+    struct poll_desc *pd = netpoll_open(fd);
+    if (!pd) return -1;
+    uint seq = atomic_load_explicit(&pd->seq, memory_order_acquire);
+    while (1) {
+        int conn = accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn >= 0) return conn;
+        if (errno_get() == EINTR || errno_get() == ECONNABORTED) continue;
+        if (errno_get() != EAGAIN) return -1;
+        if (netpoll_wait(pd, &pd->rg, seq) < 0) {
+            errno_set(EBADF);
+            return -1;
+        }
+    }
+}
+
+int co_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+    struct poll_desc *pd = netpoll_open(fd);
+    if (!pd) return -1;
+    uint seq = atomic_load_explicit(&pd->seq, memory_order_acquire);
+    if (connect(fd, addr, addrlen) == 0) return 0;
+    if (errno_get() != EINPROGRESS && errno_get() != EINTR) return -1;
+    while (1) {
+        if (netpoll_wait(pd, &pd->wg, seq) < 0) {
+            errno_set(EBADF);
+            return -1;
+        }
+        // the socket may have been reported writable before connect, make sure it is connected now
+        struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+        if (poll(&pfd, 1, 0) == 0) continue;
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) return -1;
+        if (error != 0) {
+            errno_set(error);
+            return -1;
+        }
+        return 0;
+    }
+}
+
+int co_poll_fd(int fd, short events) {
+    struct pollfd pfd = {.fd = fd, .events = events};
+    struct poll_desc *pd = netpoll_open(fd);
+    if (!pd) return errno_get() == EPERM ? poll(&pfd, 1, -1) > 0 ? pfd.revents : -1 : -1;
+    uint seq = atomic_load_explicit(&pd->seq, memory_order_acquire);
+    while (1) {
+        // readiness edges may have been consumed already, ask the kernel for the level first
+        int n = poll(&pfd, 1, 0);
+        if (n > 0) return pfd.revents;
+        if (n < 0 && errno_get() != EINTR) return -1;
+        if (n == 0 && netpoll_wait(pd, events & POLLOUT ? &pd->wg : &pd->rg, seq) < 0) {
+            errno_set(EBADF);
+            return -1;
+        }
     }
 }
 
-struct co_sem *co_sem_create(uint value) {
-    struct co_sem *sem = (struct co_sem *) malloc(sizeof(struct co_sem));
+int co_close(int fd) {
+    struct poll_desc *pd = poll_desc_get(fd);
+    if (pd && atomic_load_explicit(&pd->registered, memory_order_acquire) != 0) {
+        struct g *rg = NULL, *wg = NULL;
+        pthread_mutex_lock(&pd->mutex);
+        if (atomic_load_explicit(&pd->registered, memory_order_relaxed) > 0) {
+            atomic_fetch_add_explicit(&pd->seq, 1, memory_order_acq_rel);
+            epoll_ctl(netpoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            rg = netpoll_unblock(&pd->rg, 0);
+            wg = netpoll_unblock(&pd->wg, 0);
+        }
+        atomic_store_explicit(&pd->registered, 0, memory_order_release);
+        pthread_mutex_unlock(&pd->mutex);
+        // the waiters fail with EBADF
+        struct p *p_current = m_get_current()->p;
+        if (rg) netpoll_ready(p_current, rg);
+        if (wg) netpoll_ready(p_current, wg);
+        if (rg || wg) m_wakeup();
+    }
+    return close(fd);
+}
+
+void co_sleep(uint64_t ns) {
+    co_sleep_until(co_now() + ns);
+}
+
+void co_sleep_until(uint64_t deadline) {
+    if (deadline <= co_now()) return;
+    struct g *g_current = g_get_current();
+    g_current->timer.when = deadline;
+    g_current->timer.func = sleep_wake;
+    struct m *m_current = g_current->m;
+    co_context_switch(&g_current->co->context, &m_current->g0->co->context, CO_SLEEP); // jump to scheduler
+}
+
+// stage the operation on the M's io_uring (or hand it to the thread pool) and park until it completes
+static ssize_t co_file_io(enum co_io_op op, int fd, void *buf, size_t count, off_t offset) {
+    struct g *g_current = g_get_current();
+    struct co *co_current = g_current->co;
+    struct m *m_current = g_current->m;
+    co_current->io = (struct co_io) {.op = op, .fd = fd, .buf = buf, .count = count, .offset = offset,
+                                     .node = m_current->p->running_queues[0].node};
+    struct uring *ring = uring_get(m_current);
+    m_current->p->blocked_io = ring && uring_prep(ring, g_current) ? ring : NULL;
+    co_context_switch(&co_current->context, &m_current->g0->co->context, CO_IO_WAIT); // jump to scheduler
+    ssize_t res = co_current->io.res;
+    if (res < 0) {
+        errno_set((int) -res);
+        return -1;
+    }
+    return res;
+}
+
+ssize_t co_pread(int fd, void *buf, size_t count, off_t offset) {
+    return co_file_io(CO_IO_READ, fd, buf, count, offset);
+}
+
+ssize_t co_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    return co_file_io(CO_IO_WRITE, fd, (void *) buf, count, offset);
+}
+
+int co_fsync(int fd) {
+    return (int) co_file_io(CO_IO_FSYNC, fd, NULL, 0, 0);
+}
+
+void co_sem_destroy(struct co_sem *sem) {
     if (!sem) {
-        panic("malloc struct co_sem failed");
+        panic("semaphore is NULL");
+        return;
+    }
+    pthread_mutex_destroy(&sem->mutex);
+    list_destroy(&sem->waiters);
+    free(sem);
+}
+
+struct co_mutex *co_mutex_create() {
+    struct co_mutex *mutex = (struct co_mutex *) malloc(sizeof(struct co_mutex));
+    if (!mutex) {
+        panic("malloc struct co_mutex failed");
         return NULL;
     }
-    sem->count = value;
-    sem->mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
-    int result = pthread_mutex_init(&sem->mutex, NULL);
-    if (result != 0) {
-        free(sem);
-        panic("init semaphore mutex failed");
+    atomic_init(&mutex->state, 0);
+    pthread_mutex_init(&mutex->wait_mutex, NULL);
+    list_init(&mutex->waiters);
+    return mutex;
+}
+
+void co_mutex_lock(struct co_mutex *mutex) {
+    uint expected = 0;
+    if (atomic_compare_exchange_strong_explicit(&mutex->state, &expected, MUTEX_LOCKED,
+                                                memory_order_acquire, memory_order_relaxed)) {
+        return;
+    }
+    co_mutex_lock_slow(mutex);
+}
+
+static void co_mutex_lock_slow(struct co_mutex *mutex) {
+    struct g *g_current = g_get_current();
+    // spin while nobody is parked, parked coroutines are handed the mutex in FIFO order and never overtaken
+    for (int iter = 0;; iter++) {
+        uint state = atomic_load_explicit(&mutex->state, memory_order_relaxed);
+        if (state & MUTEX_WAITERS) break;
+        if (!state && atomic_compare_exchange_weak_explicit(&mutex->state, &state, MUTEX_LOCKED,
+                                                             memory_order_acquire, memory_order_relaxed)) {
+            return;
+        }
+        if (!lock_spin(g_current, iter)) break;
+    }
+    pthread_mutex_lock(&mutex->wait_mutex);
+    uint state = atomic_fetch_or_explicit(&mutex->state, MUTEX_WAITERS, memory_order_seq_cst) | MUTEX_WAITERS;
+    while (!(state & MUTEX_LOCKED)) { // released in the meantime
+        uint next = MUTEX_LOCKED | (list_is_empty(&mutex->waiters) ? 0 : MUTEX_WAITERS);
+        if (atomic_compare_exchange_weak_explicit(&mutex->state, &state, next,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            pthread_mutex_unlock(&mutex->wait_mutex);
+            return;
+        }
+    }
+    g_park(g_current, &mutex->waiters, &mutex->wait_mutex, TIMER_NONE);
+    // co_mutex_unlock handed the mutex over, it never became unlocked
+}
+
+int co_mutex_trylock(struct co_mutex *mutex) {
+    uint expected = 0;
+    return atomic_compare_exchange_strong_explicit(&mutex->state, &expected, MUTEX_LOCKED,
+                                                   memory_order_acquire, memory_order_relaxed);
+}
+
+void co_mutex_unlock(struct co_mutex *mutex) {
+    uint expected = MUTEX_LOCKED;
+    if (atomic_compare_exchange_strong_explicit(&mutex->state, &expected, 0,
+                                                memory_order_release, memory_order_relaxed)) {
+        return;
+    }
+    if (!(expected & MUTEX_LOCKED)) {
+        panic("co_mutex unlocked while not locked");
+        return;
+    }
+    // lockers only change state under wait_mutex now that MUTEX_WAITERS is set
+    pthread_mutex_lock(&mutex->wait_mutex);
+    struct node *node = list_pop_front(&mutex->waiters);
+    if (!node) {
+        atomic_store_explicit(&mutex->state, 0, memory_order_release);
+        pthread_mutex_unlock(&mutex->wait_mutex);
+        return;
+    }
+    struct g *waiter = list_entry(node, struct g, link);
+    waiter->wait_list = NULL;
+    if (list_is_empty(&mutex->waiters)) {
+        atomic_store_explicit(&mutex->state, MUTEX_LOCKED, memory_order_release);
+    }
+    pthread_mutex_unlock(&mutex->wait_mutex);
+    g_wake(m_get_current()->p, waiter); // handed over, still MUTEX_LOCKED
+}
+
+void co_mutex_destroy(struct co_mutex *mutex) {
+    if (!mutex) {
+        panic("co_mutex is NULL");
+        return;
+    }
+    pthread_mutex_destroy(&mutex->wait_mutex);
+    list_destroy(&mutex->waiters);
+    free(mutex);
+}
+
+struct co_rwlock *co_rwlock_create() {
+    struct co_rwlock *rwlock = (struct co_rwlock *) malloc(sizeof(struct co_rwlock));
+    if (!rwlock) {
+        panic("malloc struct co_rwlock failed");
         return NULL;
     }
-    list_init(&sem->waiters);
-    return sem;
+    atomic_init(&rwlock->state, 0);
+    pthread_mutex_init(&rwlock->wait_mutex, NULL);
+    list_init(&rwlock->readers);
+    list_init(&rwlock->writers);
+    return rwlock;
 }
 
-void co_sem_wait(struct co_sem *sem) {
-    pthread_mutex_lock(&sem->mutex);
-    if (sem->count == 0) {
-        struct g *g_current = g_get_current();
-        struct m *m_current = g_current->m;
-        struct co *co_current = g_current->co;
-        if (co_current == co_main) { // main coroutine blocked by semaphore
-            list_push_back(&sem->waiters, co_main);
-            pthread_mutex_unlock(&sem->mutex);
-            sem_wait(&co_main_sem);
+// readers are preferred, they only wait while a writer holds the lock, never for writers that wait
+void co_rwlock_rdlock(struct co_rwlock *rwlock) {
+    struct g *g_current = NULL;
+    for (int iter = 0;; iter++) {
+        uint state = atomic_load_explicit(&rwlock->state, memory_order_relaxed);
+        while (!(state & RW_WRITER)) {
+            if (atomic_compare_exchange_weak_explicit(&rwlock->state, &state, state + RW_READER,
+                                                      memory_order_acquire, memory_order_relaxed)) {
+                return;
+            }
+        }
+        if (!g_current) g_current = g_get_current();
+        if (!lock_spin(g_current, iter)) break;
+    }
+    pthread_mutex_lock(&rwlock->wait_mutex);
+    uint state = atomic_fetch_or_explicit(&rwlock->state, RW_WAITERS, memory_order_seq_cst) | RW_WAITERS;
+    while (!(state & RW_WRITER)) {
+        if (atomic_compare_exchange_weak_explicit(&rwlock->state, &state, state + RW_READER,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            pthread_mutex_unlock(&rwlock->wait_mutex);
             return;
         }
-        m_current->p->blocked_sem = sem;
-        int val = setjmp(co_current->context);
-        if (val == 0) { // suspend
-            longjmp(m_current->g0->co->context, CO_SEM_WAIT);
-        } else { // resume
+    }
+    g_park(g_current, &rwlock->readers, &rwlock->wait_mutex, TIMER_NONE);
+    // co_rwlock_wrunlock counted us in
+}
+
+void co_rwlock_rdunlock(struct co_rwlock *rwlock) {
+    uint state = atomic_fetch_sub_explicit(&rwlock->state, RW_READER, memory_order_release);
+    if (state < RW_READER) {
+        panic("co_rwlock read-unlocked without readers");
+        return;
+    }
+    if (state - RW_READER == RW_WAITERS) co_rwlock_wake_writer(rwlock); // the last reader left, writers may wait
+}
+
+// hand the rwlock to a parked writer once neither readers nor a writer hold it
+static void co_rwlock_wake_writer(struct co_rwlock *rwlock) {
+    pthread_mutex_lock(&rwlock->wait_mutex);
+    uint state = atomic_load_explicit(&rwlock->state, memory_order_relaxed);
+    while (state == RW_WAITERS) { // readers that got in since keep it, the last of them comes back here
+        uint next = 0;
+        if (!list_is_empty(&rwlock->writers)) {
+            next = RW_WRITER | (rwlock->writers.size > 1 || !list_is_empty(&rwlock->readers) ? RW_WAITERS : 0);
+        }
+        if (!atomic_compare_exchange_weak_explicit(&rwlock->state, &state, next,
+                                                   memory_order_acq_rel, memory_order_relaxed)) {
+            continue;
+        }
+        if (!next) break;
+        struct g *writer = list_entry(list_pop_front(&rwlock->writers), struct g, link);
+        writer->wait_list = NULL;
+        pthread_mutex_unlock(&rwlock->wait_mutex);
+        g_wake(m_get_current()->p, writer);
+        return;
+    }
+    pthread_mutex_unlock(&rwlock->wait_mutex);
+}
+
+void co_rwlock_wrlock(struct co_rwlock *rwlock) {
+    uint expected = 0;
+    if (atomic_compare_exchange_strong_explicit(&rwlock->state, &expected, RW_WRITER,
+                                                memory_order_acquire, memory_order_relaxed)) {
+        return;
+    }
+    struct g *g_current = g_get_current();
+    for (int iter = 0;; iter++) {
+        uint state = atomic_load_explicit(&rwlock->state, memory_order_relaxed);
+        if (state & RW_WAITERS) break;
+        if (!state && atomic_compare_exchange_weak_explicit(&rwlock->state, &state, RW_WRITER,
+                                                             memory_order_acquire, memory_order_relaxed)) {
             return;
         }
-    } else {
-        sem->count--;
-        pthread_mutex_unlock(&sem->mutex);
+        if (!lock_spin(g_current, iter)) break;
+    }
+    pthread_mutex_lock(&rwlock->wait_mutex);
+    uint state = atomic_fetch_or_explicit(&rwlock->state, RW_WAITERS, memory_order_seq_cst) | RW_WAITERS;
+    while (state == RW_WAITERS) { // released in the meantime
+        uint next = RW_WRITER | (list_is_empty(&rwlock->writers) && list_is_empty(&rwlock->readers) ? 0 : RW_WAITERS);
+        if (atomic_compare_exchange_weak_explicit(&rwlock->state, &state, next,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            pthread_mutex_unlock(&rwlock->wait_mutex);
+            return;
+        }
+    }
+    g_park(g_current, &rwlock->writers, &rwlock->wait_mutex, TIMER_NONE);
+    // handed over by the last reader or writer
+}
+
+void co_rwlock_wrunlock(struct co_rwlock *rwlock) {
+    uint expected = RW_WRITER;
+    if (atomic_compare_exchange_strong_explicit(&rwlock->state, &expected, 0,
+                                                memory_order_release, memory_order_relaxed)) {
+        return;
+    }
+    if (!(expected & RW_WRITER)) {
+        panic("co_rwlock write-unlocked without a writer");
         return;
     }
+    // with RW_WRITER and RW_WAITERS set only wait_mutex holders change state
+    pthread_mutex_lock(&rwlock->wait_mutex);
+    struct list woken;
+    list_init(&woken);
+    uint next = 0;
+    if (!list_is_empty(&rwlock->readers)) { // all parked readers get in together
+        next = (uint) rwlock->readers.size * RW_READER;
+        while (!list_is_empty(&rwlock->readers)) {
+            struct g *reader = list_entry(list_pop_front(&rwlock->readers), struct g, link);
+            reader->wait_list = NULL;
+            list_push_back(&woken, &reader->link);
+        }
+    } else if (!list_is_empty(&rwlock->writers)) {
+        next = RW_WRITER;
+        struct g *writer = list_entry(list_pop_front(&rwlock->writers), struct g, link);
+        writer->wait_list = NULL;
+        list_push_back(&woken, &writer->link);
+    }
+    if (!list_is_empty(&rwlock->writers)) next |= RW_WAITERS;
+    atomic_store_explicit(&rwlock->state, next, memory_order_release);
+    pthread_mutex_unlock(&rwlock->wait_mutex);
+    struct p *p_current = m_get_current()->p;
+    while (!list_is_empty(&woken)) {
+        g_wake(p_current, list_entry(list_pop_front(&woken), struct g, link));
+    }
 }
 
-void co_sem_post(struct co_sem *sem) {
-    pthread_mutex_lock(&sem->mutex);
-    if (list_is_empty(&sem->waiters)) {
-        sem->count++;
-        pthread_mutex_unlock(&sem->mutex);
+void co_rwlock_destroy(struct co_rwlock *rwlock) {
+    if (!rwlock) {
+        panic("co_rwlock is NULL");
         return;
-    } else {
-        struct co *waiter = (struct co *) list_pop_front(&sem->waiters);
-        pthread_mutex_unlock(&sem->mutex);
-        if (waiter == co_main) {
-            sem_post(&co_main_sem); // wake up main coroutine
+    }
+    pthread_mutex_destroy(&rwlock->wait_mutex);
+    list_destroy(&rwlock->readers);
+    list_destroy(&rwlock->writers);
+    free(rwlock);
+}
+
+struct co_cond *co_cond_create() {
+    struct co_cond *cond = (struct co_cond *) malloc(sizeof(struct co_cond));
+    if (!cond) {
+        panic("malloc struct co_cond failed");
+        return NULL;
+    }
+    atomic_init(&cond->waiting, 0);
+    pthread_mutex_init(&cond->wait_mutex, NULL);
+    list_init(&cond->waiters);
+    return cond;
+}
+
+void co_cond_wait(struct co_cond *cond, struct co_mutex *mutex) {
+    struct g *g_current = g_get_current();
+    // queued before the mutex is released, so a signal sent under the mutex cannot be missed
+    pthread_mutex_lock(&cond->wait_mutex);
+    atomic_fetch_add_explicit(&cond->waiting, 1, memory_order_relaxed);
+    co_mutex_unlock(mutex);
+    g_park(g_current, &cond->waiters, &cond->wait_mutex, TIMER_NONE);
+    co_mutex_lock(mutex);
+}
+
+void co_cond_signal(struct co_cond *cond) {
+    if (!atomic_load_explicit(&cond->waiting, memory_order_relaxed)) return;
+    pthread_mutex_lock(&cond->wait_mutex);
+    struct node *node = list_pop_front(&cond->waiters);
+    if (!node) {
+        pthread_mutex_unlock(&cond->wait_mutex);
+        return;
+    }
+    atomic_fetch_sub_explicit(&cond->waiting, 1, memory_order_relaxed);
+    struct g *waiter = list_entry(node, struct g, link);
+    waiter->wait_list = NULL;
+    pthread_mutex_unlock(&cond->wait_mutex);
+    g_wake(m_get_current()->p, waiter);
+}
+
+void co_cond_broadcast(struct co_cond *cond) {
+    if (!atomic_load_explicit(&cond->waiting, memory_order_relaxed)) return;
+    struct list woken;
+    list_init(&woken);
+    pthread_mutex_lock(&cond->wait_mutex);
+    while (!list_is_empty(&cond->waiters)) {
+        struct g *waiter = list_entry(list_pop_front(&cond->waiters), struct g, link);
+        waiter->wait_list = NULL;
+        list_push_back(&woken, &waiter->link);
+    }
+    atomic_store_explicit(&cond->waiting, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&cond->wait_mutex);
+    struct p *p_current = m_get_current()->p;
+    while (!list_is_empty(&woken)) {
+        g_wake(p_current, list_entry(list_pop_front(&woken), struct g, link));
+    }
+}
+
+void co_cond_destroy(struct co_cond *cond) {
+    if (!cond) {
+        panic("co_cond is NULL");
+        return;
+    }
+    pthread_mutex_destroy(&cond->wait_mutex);
+    list_destroy(&cond->waiters);
+    free(cond);
+}
+
+static void waitgroup_init(struct co_waitgroup *wg) {
+    atomic_init(&wg->state, 0);
+    pthread_mutex_init(&wg->wait_mutex, NULL);
+    list_init(&wg->waiters);
+}
+
+struct co_waitgroup *co_waitgroup_create() {
+    struct co_waitgroup *wg = (struct co_waitgroup *) malloc(sizeof(struct co_waitgroup));
+    if (!wg) {
+        panic("malloc struct co_waitgroup failed");
+        return NULL;
+    }
+    waitgroup_init(wg);
+    return wg;
+}
+
+static void waitgroup_add(struct p *p_current, struct co_waitgroup *wg, int delta) {
+    uint64_t diff = (uint64_t) (int64_t) delta << 32;
+    uint64_t state = atomic_fetch_add_explicit(&wg->state, diff, memory_order_acq_rel) + diff;
+    int32_t counter = (int32_t) (state >> 32);
+    uint32_t waiters = (uint32_t) state;
+    if (counter < 0) {
+        panic("co_waitgroup counter is negative");
+        return;
+    }
+    if (counter > 0 || !waiters) return; // wg may be gone once a waiter returns, do not touch it any more
+    // counted waiters cannot return before they are woken up here, and they are parked once the lock is free
+    pthread_mutex_lock(&wg->wait_mutex);
+    atomic_store_explicit(&wg->state, 0, memory_order_relaxed);
+    struct list woken;
+    list_init(&woken);
+    while (!list_is_empty(&wg->waiters)) {
+        struct g *waiter = list_entry(list_pop_front(&wg->waiters), struct g, link);
+        waiter->wait_list = NULL;
+        list_push_back(&woken, &waiter->link);
+    }
+    pthread_mutex_unlock(&wg->wait_mutex);
+    while (!list_is_empty(&woken)) {
+        g_wake(p_current, list_entry(list_pop_front(&woken), struct g, link));
+    }
+}
+
+void co_waitgroup_add(struct co_waitgroup *wg, int delta) {
+    waitgroup_add(m_get_current()->p, wg, delta);
+}
+
+void co_waitgroup_done(struct co_waitgroup *wg) {
+    waitgroup_add(m_get_current()->p, wg, -1);
+}
+
+void co_waitgroup_wait(struct co_waitgroup *wg) {
+    if (!(atomic_load_explicit(&wg->state, memory_order_acquire) >> 32)) return;
+    pthread_mutex_lock(&wg->wait_mutex);
+    uint64_t state = atomic_load_explicit(&wg->state, memory_order_acquire);
+    while (state >> 32) {
+        if (atomic_compare_exchange_weak_explicit(&wg->state, &state, state + 1,
+                                                  memory_order_acq_rel, memory_order_acquire)) {
+            g_park(g_get_current(), &wg->waiters, &wg->wait_mutex, TIMER_NONE);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&wg->wait_mutex);
+}
+
+void co_waitgroup_destroy(struct co_waitgroup *wg) {
+    if (!wg) {
+        panic("co_waitgroup is NULL");
+        return;
+    }
+    pthread_mutex_destroy(&wg->wait_mutex);
+    list_destroy(&wg->waiters);
+    free(wg);
+}
+
+void co_wait_all(struct co **cos, size_t n) {
+    // one group counted down by every target on exit, its nodes must outlive a shared stack being saved away
+    struct co_waitgroup *wg = (struct co_waitgroup *) malloc(sizeof(struct co_waitgroup) + n * sizeof(struct exit_node));
+    if (!wg) {
+        panic("malloc co_wait_all group failed");
+        return;
+    }
+    struct exit_node *nodes = (struct exit_node *) (wg + 1);
+    waitgroup_init(wg);
+    struct p *p_current = m_get_current()->p;
+    for (size_t i = 0; i < n; i++) {
+        struct co *co = cos[i];
+        if (!co || co == co_main) {
+            panic("co is NULL or main coroutine");
             return;
         }
-        pthread_mutex_lock(&waiter->status_mutex);
-        if (waiter->status == CO_WAITING) {
-            waiter->status = CO_RUNNING;
-            pthread_mutex_unlock(&waiter->status_mutex);
-            struct g *g_waiter = waiter->g;
-            struct m *m_current = m_get_current();
-            p_running_push(m_current, m_current->p, g_waiter);
+        pthread_mutex_lock(&co->status_mutex);
+        if (co->status != CO_DEAD) {
+            waitgroup_add(p_current, wg, 1);
+            nodes[i].wg = wg;
+            list_push_back(&co->exit_nodes, &nodes[i].link);
+        }
+        pthread_mutex_unlock(&co->status_mutex);
+    }
+    co_waitgroup_wait(wg);
+    pthread_mutex_destroy(&wg->wait_mutex);
+    free(wg);
+}
+
+struct co_chan *co_chan_create(size_t elem_size, uint capacity) {
+    struct co_chan *chan = (struct co_chan *) malloc(sizeof(struct co_chan));
+    if (!chan) {
+        panic("malloc struct co_chan failed");
+        return NULL;
+    }
+    chan->buf = NULL;
+    if (capacity && !(chan->buf = (uint8_t *) malloc(elem_size * capacity))) {
+        free(chan);
+        panic("malloc channel buffer failed");
+        return NULL;
+    }
+    pthread_mutex_init(&chan->mutex, NULL);
+    chan->elem_size = elem_size;
+    chan->capacity = capacity;
+    chan->head = 0;
+    chan->count = 0;
+    chan->closed = 0;
+    list_init(&chan->recvq);
+    list_init(&chan->sendq);
+    return chan;
+}
+
+// the distinct channels of cases sorted by address, every co_select locks them in this order
+static int chan_lock_order(struct co_select_case *cases, int n, struct co_chan **order) {
+    int nchan = 0;
+    for (int i = 0; i < n; i++) {
+        struct co_chan *chan = cases[i].chan;
+        if (!chan) continue;
+        int j = nchan;
+        while (j > 0 && (uintptr_t) order[j - 1] > (uintptr_t) chan) j--;
+        if (j > 0 && order[j - 1] == chan) continue;
+        memmove(&order[j + 1], &order[j], (nchan - j) * sizeof(struct co_chan *));
+        order[j] = chan;
+        nchan++;
+    }
+    return nchan;
+}
+
+static void chan_lock_all(struct co_chan **order, int nchan) {
+    for (int i = 0; i < nchan; i++) {
+        pthread_mutex_lock(&order[i]->mutex);
+    }
+}
+
+static void chan_unlock_all(struct co_chan **order, int nchan) {
+    for (int i = nchan - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&order[i]->mutex);
+    }
+}
+
+// take the first waiter of queue whose co_select is not completed yet and claim it, the caller holds the
+// channel lock; waiters of completed selects are dropped, their owners find them unlinked
+static struct chan_waiter *chan_claim(struct list *queue) {
+    while (!list_is_empty(queue)) {
+        struct chan_waiter *w = list_entry(list_pop_front(queue), struct chan_waiter, link);
+        int expected = 0;
+        if (atomic_compare_exchange_strong_explicit(&w->select->done, &expected, 1,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            w->select->index = w->index;
+            return w;
+        }
+    }
+    return NULL;
+}
+
+// complete case c without parking if it can be, the caller holds the channel lock;
+// a parked peer it completes is returned in *peer, to be woken up once the lock is released
+static int chan_try(struct co_select_case *c, struct chan_waiter **peer) {
+    struct co_chan *chan = c->chan;
+    size_t size = chan->elem_size;
+    struct chan_waiter *w;
+    *peer = NULL;
+    if (c->send) {
+        if (chan->closed) {
+            c->ok = 0;
+            return 1;
+        }
+        if ((w = chan_claim(&chan->recvq))) { // hand the element over to the receiver directly
+            if (w->elem) memcpy(w->elem, c->elem, size);
+            w->select->ok = 1;
+            *peer = w;
+        } else if (chan->count < chan->capacity) {
+            memcpy(chan->buf + (size_t) ((chan->head + chan->count) % chan->capacity) * size, c->elem, size);
+            chan->count++;
+        } else {
+            return 0;
+        }
+        c->ok = 1;
+        return 1;
+    }
+    if ((w = chan_claim(&chan->sendq))) {
+        if (!chan->capacity) { // take the element from the sender directly
+            if (c->elem) memcpy(c->elem, w->elem, size);
+        } else { // the buffer is full, take its head and let the sender refill that slot as the new tail
+            uint8_t *slot = chan->buf + (size_t) chan->head * size;
+            if (c->elem) memcpy(c->elem, slot, size);
+            memcpy(slot, w->elem, size);
+            chan->head = (chan->head + 1) % chan->capacity;
+        }
+        w->select->ok = 1;
+        *peer = w;
+    } else if (chan->count > 0) {
+        if (c->elem) memcpy(c->elem, chan->buf + (size_t) chan->head * size, size);
+        chan->head = (chan->head + 1) % chan->capacity;
+        chan->count--;
+    } else if (chan->closed) {
+        if (c->elem) memset(c->elem, 0, size);
+        c->ok = 0;
+        return 1;
+    } else {
+        return 0;
+    }
+    c->ok = 1;
+    return 1;
+}
+
+int co_select(struct co_select_case *cases, int n, int block) {
+    struct g *g_current = g_get_current();
+    struct co *co_current = g_current->co;
+    struct co_chan *order_local[CHAN_SELECT_LOCAL];
+    struct co_chan **order = n <= CHAN_SELECT_LOCAL ? order_local : malloc(n * sizeof(struct co_chan *));
+    if (!order) {
+        panic("malloc co_select lock order failed");
+        return -1;
+    }
+    int nchan = chan_lock_order(cases, n, order);
+    if (!nchan && block) {
+        panic("co_select without channels blocks forever");
+        return -1;
+    }
+    chan_lock_all(order, nchan);
+    // poll the cases from a random start so that none of them starves the others
+    uint start = n ? fastrand(g_current->m) % n : 0;
+    for (int k = 0; k < n; k++) {
+        int i = (int) ((start + k) % n);
+        struct chan_waiter *peer;
+        if (!cases[i].chan || !chan_try(&cases[i], &peer)) continue;
+        chan_unlock_all(order, nchan);
+        if (peer) g_wake(g_current->m->p, peer->g);
+        if (order != order_local) free(order);
+        return i;
+    }
+    if (!block) {
+        chan_unlock_all(order, nchan);
+        if (order != order_local) free(order);
+        return -1;
+    }
+    // park with a waiter on every channel; wakers cannot reach into a shared stack that has been saved away,
+    // so there the waiters and copies of the elements are allocated
+    struct chan_select select_local;
+    struct chan_waiter waiters_local[CHAN_SELECT_LOCAL];
+    struct chan_select *select = &select_local;
+    struct chan_waiter *waiters = waiters_local;
+    uint8_t *copies = NULL;
+    if (co_current->shared || n > CHAN_SELECT_LOCAL) {
+        size_t copies_size = 0;
+        for (int i = 0; co_current->shared && i < n; i++) {
+            if (cases[i].chan) copies_size += cases[i].chan->elem_size;
+        }
+        select = malloc(sizeof(struct chan_select) + n * sizeof(struct chan_waiter) + copies_size);
+        if (!select) {
+            chan_unlock_all(order, nchan);
+            panic("malloc co_select waiters failed");
+            return -1;
+        }
+        waiters = (struct chan_waiter *) (select + 1);
+        if (co_current->shared) copies = (uint8_t *) (waiters + n);
+    }
+    atomic_init(&select->done, 0);
+    select->order = order;
+    select->nchan = nchan;
+    int parked = 0;
+    for (int i = 0; i < n; i++) {
+        struct co_chan *chan = cases[i].chan;
+        if (!chan) continue;
+        struct chan_waiter *w = &waiters[i];
+        w->g = g_current;
+        w->select = select;
+        w->index = i;
+        w->elem = cases[i].elem;
+        if (copies) {
+            w->elem = copies;
+            if (cases[i].send) memcpy(copies, cases[i].elem, chan->elem_size);
+            copies += chan->elem_size;
+        }
+        list_push_back(cases[i].send ? &chan->sendq : &chan->recvq, &w->link);
+        parked++;
+    }
+    g_current->wait_timed = 0;
+    g_current->m->p->blocked_select = select;
+    co_context_switch(&co_current->context, &g_current->m->g0->co->context, CO_CHAN_WAIT);
+    // the waker took the completed waiter off, take off those left on the other channels
+    if (parked > 1) {
+        chan_lock_all(order, nchan);
+        for (int i = 0; i < n; i++) {
+            if (!cases[i].chan || !waiters[i].link.next) continue;
+            list_erase(cases[i].send ? &cases[i].chan->sendq : &cases[i].chan->recvq, &waiters[i].link);
+        }
+        chan_unlock_all(order, nchan);
+    }
+    int index = select->index;
+    cases[index].ok = select->ok;
+    if (copies && !cases[index].send && cases[index].elem) {
+        memcpy(cases[index].elem, waiters[index].elem, cases[index].chan->elem_size);
+    }
+    if (select != &select_local) free(select);
+    if (order != order_local) free(order);
+    return index;
+}
+
+int co_chan_send(struct co_chan *chan, const void *elem) {
+    struct co_select_case c = {.chan = chan, .send = 1, .elem = (void *) elem};
+    co_select(&c, 1, 1);
+    if (!c.ok) {
+        errno_set(EPIPE);
+        return -1;
+    }
+    return 0;
+}
+
+int co_chan_recv(struct co_chan *chan, void *elem) {
+    struct co_select_case c = {.chan = chan, .elem = elem};
+    co_select(&c, 1, 1);
+    return c.ok;
+}
+
+void co_chan_close(struct co_chan *chan) {
+    pthread_mutex_lock(&chan->mutex);
+    if (chan->closed) {
+        pthread_mutex_unlock(&chan->mutex);
+        panic("channel closed twice");
+        return;
+    }
+    chan->closed = 1;
+    // parked receivers get zeroed elements and parked senders fail, woken up outside the lock
+    struct list woken;
+    list_init(&woken);
+    struct chan_waiter *w;
+    while ((w = chan_claim(&chan->recvq))) {
+        if (w->elem) memset(w->elem, 0, chan->elem_size);
+        w->select->ok = 0;
+        list_push_back(&woken, &w->link);
+    }
+    while ((w = chan_claim(&chan->sendq))) {
+        w->select->ok = 0;
+        list_push_back(&woken, &w->link);
+    }
+    pthread_mutex_unlock(&chan->mutex);
+    struct p *p_current = m_get_current()->p;
+    while (!list_is_empty(&woken)) {
+        g_wake(p_current, list_entry(list_pop_front(&woken), struct chan_waiter, link)->g);
+    }
+}
+
+void co_chan_destroy(struct co_chan *chan) {
+    if (!chan) {
+        panic("channel is NULL");
+        return;
+    }
+    pthread_mutex_destroy(&chan->mutex);
+    list_destroy(&chan->recvq);
+    list_destroy(&chan->sendq);
+    free(chan->buf);
+    free(chan);
+}
+
+static struct parallel_job *parallel_job_new(long grain, size_t size, void *ctx) {
+    struct parallel_job *job = (struct parallel_job *) calloc(1, sizeof(struct parallel_job) + size);
+    if (!job) {
+        panic("malloc struct parallel_job failed");
+        return NULL;
+    }
+    job->grain = grain > 0 ? grain : 1;
+    job->size = size;
+    job->ctx = ctx;
+    return job;
+}
+
+// lazy binary splitting: a task only splits while the running queue of its P is empty, i.e. once thieves or
+// the P itself have taken what it split off before, so the number of tasks follows the number of idle Ms
+static void parallel_run(struct parallel_task *task) {
+    struct parallel_job *job = task->job;
+    long i = task->begin;
+    while (i < task->end) {
+        if (task->end - i > job->grain && p_runq_empty(m_get_current()->p)) {
+            parallel_split(task, i + (task->end - i) / 2);
+            continue;
+        }
+        long stop = MIN(i + job->grain, task->end);
+        if (job->for_body) {
+            job->for_body(i, stop, job->ctx);
         } else {
-            pthread_mutex_unlock(&waiter->status_mutex);
-            panic("co_sem's waiter status is not CO_WAITING");
+            job->reduce_body(i, stop, task->acc, job->ctx);
         }
+        i = stop;
+    }
+    // the latest child holds the range right after ours, combining in this order keeps the ranges in order
+    while (task->children) {
+        struct parallel_task *child = task->children;
+        task->children = child->next;
+        co_wait(child->co);
+        co_release(child->co);
+        if (job->combine) job->combine(task->acc, child->acc, job->ctx);
+        free(child);
     }
 }
 
-void co_sem_destroy(struct co_sem *sem) {
-    if (!sem) {
-        panic("semaphore is NULL");
+// hand [mid, task->end) over to a new coroutine of the same priority in the current P's running queue
+static void parallel_split(struct parallel_task *task, long mid) {
+    struct parallel_job *job = task->job;
+    struct parallel_task *child = (struct parallel_task *) malloc(sizeof(struct parallel_task) + job->size);
+    if (!child) {
+        panic("malloc struct parallel_task failed");
         return;
     }
-    pthread_mutex_destroy(&sem->mutex);
-    list_destroy(&sem->waiters);
-    free(sem);
+    child->job = job;
+    child->begin = mid;
+    child->end = task->end;
+    child->children = NULL;
+    child->acc = job->size ? child->acc_inline : NULL;
+    if (job->size) memcpy(child->acc, job->identity, job->size);
+    task->end = mid;
+    child->next = task->children;
+    task->children = child;
+    struct p *p_current = m_get_current()->p;
+    struct g *g = co_create(p_current, "parallel", parallel_entry, child, NULL);
+    g->priority = g_get_current()->priority;
+    child->co = g->co;
+    p_running_push(p_current, g);
+    m_wakeup();
+}
+
+static void parallel_entry(void *arg) {
+    parallel_run((struct parallel_task *) arg);
+}
+
+void co_parallel_for(long begin, long end, long grain, void (*body)(long begin, long end, void *ctx), void *ctx) {
+    if (!body) {
+        panic("co_parallel_for body is NULL");
+        return;
+    }
+    struct parallel_job *job = parallel_job_new(grain, 0, ctx);
+    job->for_body = body;
+    struct parallel_task root = {.job = job, .begin = begin, .end = end, .children = NULL, .acc = NULL};
+    parallel_run(&root);
+    free(job);
+}
+
+void co_parallel_reduce(long begin, long end, long grain, const void *identity, void *result, size_t size,
+                        void (*body)(long begin, long end, void *acc, void *ctx),
+                        void (*combine)(void *acc, const void *other, void *ctx), void *ctx) {
+    if (!body || !combine || !identity || !result || size == 0) {
+        panic("co_parallel_reduce argument is NULL or empty");
+        return;
+    }
+    struct parallel_job *job = parallel_job_new(grain, size, ctx);
+    job->reduce_body = body;
+    job->combine = combine;
+    memcpy(job->identity, identity, size);
+    memcpy(result, identity, size);
+    struct parallel_task root = {.job = job, .begin = begin, .end = end, .children = NULL, .acc = result};
+    parallel_run(&root);
+    free(job);
 }
 
 __attribute__((destructor))
 static void co_destroy() {
-    atomic_store_explicit(&exit_signal, 1, memory_order_release);
-    free(pthread_getspecific(tls_key_g_current));
-    for (int i = 0; i < M_NUM; i++) {
-        if (i != 0) {
-            pthread_join(m_set[i].thread_id, NULL);
-        }
+    atomic_store_explicit(&exit_signal, 1, memory_order_seq_cst);
+    netpoll_break();
+    for (uint i = 1; i < m_num; i++) {
+        atomic_store_explicit(&m_set[i].park_word, 1, memory_order_seq_cst);
+        futex_wake(&m_set[i].park_word);
+    }
+    preempt_stop();
+    // other Ms may still steal from any P until they have all stopped
+    for (uint i = 1; i < m_num; i++) {
+        pthread_join(m_set[i].thread_id, NULL);
+    }
+    io_pool_stop();
+    g_destroy(co_main->g);
+    for (uint i = 0; i < m_num; i++) {
         g_destroy(m_set[i].g0);
         p_destroy(&p_set[i]);
+        if (m_set[i].shared_stack) {
+            stack_free(NULL, m_set[i].shared_stack, shared_stack_size);
+        }
+        if (m_set[i].uring) {
+            uring_destroy(m_set[i].uring);
+        }
+    }
+    free(m_set);
+    free(p_set);
+    // destroy injection queues and depots
+    for (uint i = 0; i < node_num; i++) {
+        mq_destroy(&node_queues[i]);
     }
-    // destroy semaphore of main
-    sem_destroy(&co_main_sem);
-    // destroy global queue
-    mq_destroy(&global_queue);
-    // destroy TLS key
-    pthread_key_delete(tls_key_g_current);
+    free(node_queues);
+    depot_destroy(&stack_depot, stack_release);
+    depot_destroy(&g_depot, free);
+    netpoll_destroy();
 }
\ No newline at end of file
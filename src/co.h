@@ -1,9 +1,34 @@
 #ifndef COROUTINE_C_CO_H
 #define COROUTINE_C_CO_H
 
-/// @brief Initialize the coroutine library.
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/// @brief Runtime configuration, fields left as zero take their default values.
+struct co_config {
+    unsigned int m_num;          // number of Ms (threads) running coroutines, counting main's, which runs them
+                                 // while main is blocked; defaults to the online CPUs clamped by the cgroup v2
+                                 // cpu.max quota
+    size_t stack_size;           // stack size of every coroutine in bytes, defaults to 16KB
+    unsigned int run_queue_size; // capacity of each P's running queue, rounded up to a power of 2, defaults to 256
+    size_t shared_stack_size;    // size of the stack each M shares among its shared-stack coroutines, defaults to 1MB
+    int disable_io_uring;        // non-zero to serve co_pread / co_pwrite / co_fsync from a thread pool,
+                                 // which is also used when the kernel lacks io_uring
+    uint64_t time_slice;         // nanoseconds a preemptible coroutine runs before it is switched out, defaults to 10ms
+    int disable_affinity;        // non-zero to leave Ms unpinned; by default, given a CPU for each, Ms besides main's
+                                 // are pinned to CPUs ordered by NUMA node, cache and core
+};
+
+/// @brief Initialize the coroutine library with the default configuration.
 void co_init();
 
+/** @brief Initialize the coroutine library.
+  * @param config The runtime configuration, NULL for the default one.
+  */
+void co_init_ex(const struct co_config *config);
+
 /** @brief Create a new coroutine (but not execute it at once).
   * @param name The name of the coroutine.
   * @param func The function to be executed.
@@ -12,6 +37,67 @@ void co_init();
   */
 struct co *co_start(const char *name, void (*func)(void *), void *arg);
 
+/// @brief Scheduling classes, each P keeps a running queue per class and picks between them by weight.
+enum co_priority {
+    CO_PRIORITY_NORMAL = 0,
+    CO_PRIORITY_CRITICAL,   // latency-critical, picked several times as often as normal coroutines
+    CO_PRIORITY_BACKGROUND, // runs when nothing else is queued, and only now and then otherwise
+};
+
+/// @brief Attributes of a new coroutine, fields left as zero take their default values.
+struct co_attr {
+    size_t stack_size; // stack size in bytes, rounded up to whole pages, defaults to co_config.stack_size
+    int shared_stack;  // non-zero to run on the shared stack of an M instead of a stack of its own,
+                       // stack_size is ignored then
+    int preemptible;   // non-zero to switch it out by a signal once it has run for a time slice without yielding,
+                       // it is not interrupted inside libco, libc or the dynamic loader
+    enum co_priority priority; // scheduling class, ignored while the coroutine is pinned to one M (shared stack)
+};
+
+/** @brief Create a new coroutine with attributes (but not execute it at once).
+  *        Stacks are mapped with a guard page below them and only touched pages are committed,
+  *        so a large stack costs no more memory than the depth actually used.
+  *        A shared-stack coroutine runs on the stack of the M that first runs it and stays on that M,
+  *        only the depth in use is copied out when another coroutine takes the stack over, which suits
+  *        large numbers of mostly idle coroutines. Pointers to its locals are only valid while it runs.
+  *        A preemptible coroutine may be switched out between any two instructions of its own code, so it
+  *        must not hold a pthread lock while running long, and it needs room for a signal frame on its stack.
+  * @param name The name of the coroutine.
+  * @param func The function to be executed.
+  * @param arg The argument to be passed to the function.
+  * @param attr The attributes of the coroutine, NULL for the defaults.
+  * @return A pointer to the new coroutine, panic once failed.
+  */
+struct co *co_start_attr(const char *name, void (*func)(void *), void *arg, const struct co_attr *attr);
+
+/** @brief Create n coroutines running func at once, with the default attributes.
+  *        They are queued in one pass and just enough idle threads are woken for them,
+  *        which is cheaper than n calls to co_start when fanning out.
+  * @param name The name of every new coroutine.
+  * @param func The function to be executed.
+  * @param args The argument of each coroutine, NULL passes NULL to all of them.
+  * @param n The number of coroutines to create.
+  * @param cos Receives the new coroutines, release each of them as if started by co_start.
+  */
+void co_start_batch(const char *name, void (*func)(void *), void **args, size_t n, struct co **cos);
+
+/// @brief The result of a coroutine started by co_spawn, kept inside the coroutine itself.
+union co_value {
+    int64_t i;
+    uint64_t u;
+    double d;
+    void *p;
+};
+
+/** @brief Create a new coroutine whose function returns a value (but not execute it at once).
+  *        The value is stored in the coroutine, retrieve it with co_await_result.
+  * @param name The name of the coroutine.
+  * @param func The function to be executed.
+  * @param arg The argument to be passed to the function.
+  * @return A pointer to the new coroutine, panic once failed. It is released like one started by co_start.
+  */
+struct co *co_spawn(const char *name, union co_value (*func)(void *), void *arg);
+
 /// @brief Switch to another coroutine.
 void co_yield();
 
@@ -20,6 +106,126 @@ void co_yield();
   */
 void co_wait(struct co *co);
 
+/** @brief Wait for a coroutine started by co_spawn to finish and return its result.
+  *        The handle stays valid, so the result can be read again until it is released.
+  * @param co The coroutine to wait for.
+  * @return The value returned by its function.
+  */
+union co_value co_await_result(struct co *co);
+
+/** @brief Wait for several coroutines to finish, parking the caller once until the last of them exits.
+  * @param cos The coroutines to wait for.
+  * @param n The number of coroutines.
+  */
+void co_wait_all(struct co **cos, size_t n);
+
+/** @brief Wait for a coroutine to finish, giving up at a deadline.
+  * @param co The coroutine to wait for.
+  * @param deadline The time to give up at, as returned by co_now.
+  * @return 0 once co has finished, -1 with errno set to ETIMEDOUT if the deadline passed first.
+  */
+int co_wait_timeout(struct co *co, uint64_t deadline);
+
+/** @brief Release the handle of a coroutine. The coroutine is freed once it has finished and its handle
+  *        has been released, the handle must not be used afterwards. Every handle returned by co_start
+  *        must be released or detached, or memory leaks would occur.
+  * @param co The coroutine to release, typically after co_wait.
+  */
+void co_release(struct co *co);
+
+/** @brief Give up the handle of a coroutine that may still be running, it is freed as soon as it finishes.
+  *        Same as co_release, named for fire-and-forget coroutines that are never waited for.
+  * @param co The coroutine to detach.
+  */
+void co_detach(struct co *co);
+
+/** @brief Read from a file descriptor, blocking only the calling coroutine until data is available.
+  *        Sockets, pipes and the like are made non-blocking and registered with the netpoller on first use,
+  *        they must then be closed with co_close. Other fds (e.g. regular files) are read as usual.
+  * @param fd The file descriptor to read from.
+  * @param buf The buffer to read into.
+  * @param count The size of the buffer.
+  * @return The number of bytes read, 0 at end of file, -1 with errno set on error.
+  */
+ssize_t co_read(int fd, void *buf, size_t count);
+
+/** @brief Write a whole buffer to a file descriptor, blocking only the calling coroutine while fd is full.
+  * @param fd The file descriptor to write to.
+  * @param buf The data to write.
+  * @param count The size of the data.
+  * @return count, or the number of bytes written before an error, -1 with errno set if none was.
+  */
+ssize_t co_write(int fd, const void *buf, size_t count);
+
+/** @brief Accept a connection, blocking only the calling coroutine until one arrives.
+  * @param fd The listening socket.
+  * @param addr Filled with the address of the peer, may be NULL.
+  * @param addrlen The size of addr, updated to the actual size, may be NULL.
+  * @return The connected socket (non-blocking), -1 with errno set on error.
+  */
+int co_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/** @brief Connect a socket, blocking only the calling coroutine until the connection is established.
+  * @param fd The socket to connect.
+  * @param addr The address to connect to.
+  * @param addrlen The size of addr.
+  * @return 0 on success, -1 with errno set on error.
+  */
+int co_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+/** @brief Wait until a file descriptor is ready, blocking only the calling coroutine.
+  * @param fd The file descriptor to wait for.
+  * @param events POLLIN or POLLOUT.
+  * @return The returned events as for poll(2), -1 with errno set on error.
+  */
+int co_poll_fd(int fd, short events);
+
+/** @brief Close a file descriptor, coroutines blocked on it fail with EBADF.
+  * @param fd The file descriptor to close.
+  * @return As for close(2).
+  */
+int co_close(int fd);
+
+/** @brief Read from a file at an offset, blocking only the calling coroutine. The operation is submitted to
+  *        an io_uring of the running M together with those of the other coroutines of the same round,
+  *        or served by a thread pool when io_uring is unavailable.
+  * @param fd The file descriptor to read from.
+  * @param buf The buffer to read into, it must stay valid (not on a shared stack) until the call returns.
+  * @param count The size of the buffer.
+  * @param offset The file offset to read at.
+  * @return The number of bytes read, 0 at end of file, -1 with errno set on error.
+  */
+ssize_t co_pread(int fd, void *buf, size_t count, off_t offset);
+
+/** @brief Write to a file at an offset, blocking only the calling coroutine, see co_pread.
+  * @param fd The file descriptor to write to.
+  * @param buf The data to write, not on a shared stack.
+  * @param count The size of the data.
+  * @param offset The file offset to write at.
+  * @return The number of bytes written, -1 with errno set on error.
+  */
+ssize_t co_pwrite(int fd, const void *buf, size_t count, off_t offset);
+
+/** @brief Flush a file to its storage device, blocking only the calling coroutine, see co_pread.
+  * @param fd The file descriptor to flush.
+  * @return 0 on success, -1 with errno set on error.
+  */
+int co_fsync(int fd);
+
+/// @brief The current time of CLOCK_MONOTONIC in nanoseconds, the clock of co_sleep_until.
+uint64_t co_now();
+
+/** @brief Suspend the calling coroutine for a while, other coroutines keep running on its M.
+  *        Timers have a resolution of 1ms and never fire early.
+  * @param ns The time to sleep in nanoseconds.
+  */
+void co_sleep(uint64_t ns);
+
+/** @brief Suspend the calling coroutine until a deadline, see co_sleep.
+  * @param deadline The time to wake up at, as returned by co_now.
+  */
+void co_sleep_until(uint64_t deadline);
+
 /** @brief Create a semaphore.
   * @param value The initial value of the semaphore.
   * @return A pointer to the initialized semaphore.
@@ -31,6 +237,13 @@ struct co_sem *co_sem_create(unsigned int value);
   */
 void co_sem_wait(struct co_sem *sem);
 
+/** @brief Wait on a semaphore, giving up at a deadline.
+  * @param sem The semaphore to wait on.
+  * @param deadline The time to give up at, as returned by co_now.
+  * @return 0 once the semaphore is taken, -1 with errno set to ETIMEDOUT if the deadline passed first.
+  */
+int co_sem_timedwait(struct co_sem *sem, uint64_t deadline);
+
 /** @brief Post (signal) a semaphore, releasing it. This function will wake up one coroutine waiting on the semaphore.
   * @param sem The semaphore to post.
   */
@@ -42,4 +255,162 @@ void co_sem_post(struct co_sem *sem);
   */
 void co_sem_destroy(struct co_sem *sem);
 
+/** @brief Create a mutex. Uncontended lock and unlock are a single atomic operation,
+  *        a contended lock spins briefly and then parks the coroutine; parked coroutines get the mutex in FIFO order.
+  * @return A pointer to the new mutex, panic once failed.
+  */
+struct co_mutex *co_mutex_create();
+
+/// @brief Lock a mutex, blocking the calling coroutine while another one holds it.
+void co_mutex_lock(struct co_mutex *mutex);
+
+/** @brief Lock a mutex if nobody holds it.
+  * @return 1 if the mutex was locked, 0 otherwise.
+  */
+int co_mutex_trylock(struct co_mutex *mutex);
+
+/// @brief Unlock a mutex, handing it over to the first parked coroutine if any.
+void co_mutex_unlock(struct co_mutex *mutex);
+
+/// @brief Destroy a mutex, which must not be locked.
+void co_mutex_destroy(struct co_mutex *mutex);
+
+/** @brief Create a reader-preferring read-write lock: readers never wait for waiting writers, only for a holding one.
+  * @return A pointer to the new read-write lock, panic once failed.
+  */
+struct co_rwlock *co_rwlock_create();
+
+/// @brief Lock for reading, shared with other readers.
+void co_rwlock_rdlock(struct co_rwlock *rwlock);
+
+/// @brief Release a read lock.
+void co_rwlock_rdunlock(struct co_rwlock *rwlock);
+
+/// @brief Lock for writing, exclusively.
+void co_rwlock_wrlock(struct co_rwlock *rwlock);
+
+/// @brief Release the write lock, letting all waiting readers in at once, or else one waiting writer.
+void co_rwlock_wrunlock(struct co_rwlock *rwlock);
+
+/// @brief Destroy a read-write lock, which must not be locked.
+void co_rwlock_destroy(struct co_rwlock *rwlock);
+
+/** @brief Create a condition variable.
+  * @return A pointer to the new condition variable, panic once failed.
+  */
+struct co_cond *co_cond_create();
+
+/** @brief Unlock a mutex and park until signaled, then lock the mutex again. Wake-ups may be spurious.
+  * @param cond The condition variable to wait on.
+  * @param mutex The mutex held by the calling coroutine.
+  */
+void co_cond_wait(struct co_cond *cond, struct co_mutex *mutex);
+
+/// @brief Wake up the coroutine waiting longest on a condition variable, if any.
+void co_cond_signal(struct co_cond *cond);
+
+/// @brief Wake up all coroutines waiting on a condition variable.
+void co_cond_broadcast(struct co_cond *cond);
+
+/// @brief Destroy a condition variable, no coroutine may wait on it.
+void co_cond_destroy(struct co_cond *cond);
+
+/** @brief Create a wait group, a counter that coroutines can wait on to drop to zero.
+  * @return A pointer to the new wait group, panic once failed.
+  */
+struct co_waitgroup *co_waitgroup_create();
+
+/** @brief Add to the counter of a wait group, waking up all its waiters once it drops to zero.
+  * @param wg The wait group.
+  * @param delta The amount to add, the counter must not become negative.
+  */
+void co_waitgroup_add(struct co_waitgroup *wg, int delta);
+
+/// @brief Decrement the counter of a wait group, same as co_waitgroup_add(wg, -1).
+void co_waitgroup_done(struct co_waitgroup *wg);
+
+/// @brief Block until the counter of a wait group is zero.
+void co_waitgroup_wait(struct co_waitgroup *wg);
+
+/// @brief Destroy a wait group, no coroutine may wait on it.
+void co_waitgroup_destroy(struct co_waitgroup *wg);
+
+/** @brief Create a channel of fixed-size elements, which are copied in and out.
+  * @param elem_size The size of an element in bytes.
+  * @param capacity The number of elements buffered, 0 for an unbuffered channel where a sender waits for a receiver.
+  * @return A pointer to the new channel, panic once failed.
+  */
+struct co_chan *co_chan_create(size_t elem_size, unsigned int capacity);
+
+/** @brief Send an element, blocking while the channel is full (or has no receiver if unbuffered).
+  *        A receiver already waiting gets the element copied directly.
+  * @param chan The channel to send on.
+  * @param elem The element to copy into the channel.
+  * @return 0 on success, -1 with errno set to EPIPE if the channel is or gets closed.
+  */
+int co_chan_send(struct co_chan *chan, const void *elem);
+
+/** @brief Receive an element, blocking while the channel is empty and open.
+  * @param chan The channel to receive from.
+  * @param elem Where to copy the element, NULL to drop it.
+  * @return 1 if an element was received, 0 if the channel is closed and drained (elem is zeroed then).
+  */
+int co_chan_recv(struct co_chan *chan, void *elem);
+
+/** @brief Close a channel. Buffered elements can still be received, waiting senders fail and waiting receivers get 0.
+  * @param chan The channel to close, closing it twice panics.
+  */
+void co_chan_close(struct co_chan *chan);
+
+/** @brief Destroy a channel, freeing its resources. No coroutine may still use it.
+  * @param chan The channel to destroy.
+  */
+void co_chan_destroy(struct co_chan *chan);
+
+/// @brief One channel operation of co_select.
+struct co_select_case {
+    struct co_chan *chan; // NULL cases are never chosen
+    int send;             // non-zero to send *elem, zero to receive into elem (NULL drops the element)
+    void *elem;
+    int ok;               // set on the chosen case, 1 if the element was sent or received, 0 if the channel is closed
+};
+
+/** @brief Complete one of several channel operations, parking the coroutine once until one of them can.
+  *        Among the cases that can complete right away one is chosen at random.
+  * @param cases The operations.
+  * @param n The number of cases.
+  * @param block Zero to return -1 at once when no case can complete.
+  * @return The index of the completed case, whose ok field tells how it completed.
+  */
+int co_select(struct co_select_case *cases, int n, int block);
+
+/** @brief Run body over the indices [begin, end) in parallel and return once all of them are done.
+  *        The range is split in halves on demand only: a coroutine splits off the upper half of what it has left
+  *        whenever its processor has nothing else queued, so there are about as many pieces as idle threads.
+  *        The calling coroutine takes part in the work.
+  * @param begin The first index.
+  * @param end One past the last index.
+  * @param grain The most indices a single call of body gets, and the least worth splitting, at least 1.
+  * @param body Called on disjoint sub-ranges [begin, end), possibly from several threads at once.
+  * @param ctx Passed to body.
+  */
+void co_parallel_for(long begin, long end, long grain, void (*body)(long begin, long end, void *ctx), void *ctx);
+
+/** @brief Reduce the indices [begin, end) in parallel, split the same way as co_parallel_for.
+  *        Every piece starts from a copy of identity, adjacent partial results are combined in index order,
+  *        so combine has to be associative but not commutative.
+  * @param begin The first index.
+  * @param end One past the last index.
+  * @param grain The most indices a single call of body gets, and the least worth splitting, at least 1.
+  * @param identity The neutral partial result, size bytes.
+  * @param result Receives the result, size bytes.
+  * @param size The size of a partial result.
+  * @param body Accumulates a sub-range [begin, end) into acc.
+  * @param combine Accumulates other, the partial result of the range right after that of acc, into acc.
+  * @param ctx Passed to body and combine.
+  */
+void co_parallel_reduce(long begin, long end, long grain, const void *identity, void *result, size_t size,
+                        void (*body)(long begin, long end, void *acc, void *ctx),
+                        void (*combine)(void *acc, const void *other, void *ctx), void *ctx);
+
 #endif //COROUTINE_C_CO_H
@@ -0,0 +1,132 @@
+// chan_pipeline.c: pipeline stages over buffered and unbuffered channels, fanned in with co_select
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <co.h>
+
+#define N 100000
+#define WORKERS 8
+#define SOURCES 6 // more than co_select keeps on the stack
+#define PER_SOURCE 10000
+
+static struct co_chan *numbers, *squares;
+static struct co_chan *sources[SOURCES];
+static atomic_int workers_left = WORKERS;
+
+void generator(void *arg) {
+    (void) arg;
+    for (long i = 1; i <= N; i++) {
+        assert(co_chan_send(numbers, &i) == 0);
+    }
+    co_chan_close(numbers);
+}
+
+void squarer(void *arg) {
+    (void) arg;
+    long x;
+    while (co_chan_recv(numbers, &x)) {
+        long y = x * x;
+        assert(co_chan_send(squares, &y) == 0);
+    }
+    if (atomic_fetch_sub(&workers_left, 1) == 1) co_chan_close(squares);
+}
+
+// runs on a shared stack, so the elements of a parked co_select are copied off it
+void source(void *arg) {
+    int id = (int) (long) arg;
+    for (int i = 0; i < PER_SOURCE; i++) {
+        int v = id;
+        assert(co_chan_send(sources[id], &v) == 0);
+    }
+    co_chan_close(sources[id]);
+}
+
+void fan_in(void *arg) {
+    long *counts = arg;
+    struct co_select_case cases[SOURCES];
+    int values[SOURCES];
+    for (int i = 0; i < SOURCES; i++) {
+        cases[i] = (struct co_select_case) {.chan = sources[i], .elem = &values[i]};
+    }
+    int open = SOURCES;
+    while (open) {
+        int i = co_select(cases, SOURCES, 1);
+        if (!cases[i].ok) { // closed, never choose it again
+            cases[i].chan = NULL;
+            open--;
+            continue;
+        }
+        assert(values[i] == i);
+        counts[i]++;
+    }
+}
+
+int main() {
+    co_init();
+
+    // generator -> squarers -> main, a buffered and an unbuffered hop
+    numbers = co_chan_create(sizeof(long), 64);
+    squares = co_chan_create(sizeof(long), 0);
+    struct co *gen = co_start("generator", generator, NULL);
+    struct co *workers[WORKERS];
+    for (int i = 0; i < WORKERS; i++) {
+        workers[i] = co_start("squarer", squarer, NULL);
+    }
+    long y, sum = 0, received = 0;
+    while (co_chan_recv(squares, &y)) {
+        sum += y;
+        received++;
+    }
+    long expected = 0;
+    for (long i = 1; i <= N; i++) expected += i * i;
+    printf("Received: %ld, sum: %ld\n", received, sum);
+    assert(received == N && sum == expected);
+    co_wait(gen);
+    co_release(gen);
+    for (int i = 0; i < WORKERS; i++) {
+        co_wait(workers[i]);
+        co_release(workers[i]);
+    }
+    assert(co_chan_send(squares, &y) == -1 && errno == EPIPE);
+
+    // shared-stack sources fanned in by one co_select
+    long counts[SOURCES] = {0};
+    struct co_attr attr = {.shared_stack = 1};
+    struct co *srcs[SOURCES];
+    for (int i = 0; i < SOURCES; i++) {
+        sources[i] = co_chan_create(sizeof(int), 0);
+    }
+    struct co *fan = co_start("fan_in", fan_in, counts);
+    for (int i = 0; i < SOURCES; i++) {
+        srcs[i] = co_start_attr("source", source, (void *) (long) i, &attr);
+    }
+    for (int i = 0; i < SOURCES; i++) {
+        co_wait(srcs[i]);
+        co_release(srcs[i]);
+    }
+    co_wait(fan);
+    co_release(fan);
+    for (int i = 0; i < SOURCES; i++) {
+        assert(counts[i] == PER_SOURCE);
+        co_chan_destroy(sources[i]);
+    }
+
+    // a non-blocking select finds nothing, then the buffered element
+    struct co_chan *one = co_chan_create(sizeof(int), 1);
+    int v = 0;
+    struct co_select_case c = {.chan = one, .elem = &v};
+    assert(co_select(&c, 1, 0) == -1);
+    int w = 42;
+    assert(co_chan_send(one, &w) == 0);
+    assert(co_select(&c, 1, 0) == 0 && c.ok && v == 42);
+    co_chan_close(one);
+    assert(co_chan_recv(one, &v) == 0 && v == 0);
+
+    printf("Channel pipeline test passed!\n");
+    co_chan_destroy(one);
+    co_chan_destroy(numbers);
+    co_chan_destroy(squares);
+    return 0;
+}
@@ -0,0 +1,42 @@
+// detach_churn.c: memory stays bounded while a million detached coroutines come and go
+#include <stdio.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <co.h>
+
+#define TOTAL 1000000
+#define WAVE 1000
+#define MAX_RSS_KB (64 * 1024) // without reclaiming, a million coroutines take several hundred MB
+
+static struct co_sem *wave_sem;
+static atomic_int finished = 0;
+
+void worker(void *arg) {
+    (void) arg;
+    atomic_fetch_add(&finished, 1);
+    co_sem_post(wave_sem);
+}
+
+int main() {
+    co_init();
+    wave_sem = co_sem_create(0);
+
+    for (int wave = 0; wave < TOTAL / WAVE; wave++) {
+        for (int i = 0; i < WAVE; i++) {
+            co_detach(co_start("churn", worker, NULL));
+        }
+        for (int i = 0; i < WAVE; i++) {
+            co_sem_wait(wave_sem);
+        }
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Finished: %d, max RSS: %ld KB\n", atomic_load(&finished), usage.ru_maxrss);
+    assert(atomic_load(&finished) == TOTAL);
+    assert(usage.ru_maxrss < MAX_RSS_KB);
+    printf("Detach churn test passed!\n");
+    co_sem_destroy(wave_sem);
+    return 0;
+}
@@ -0,0 +1,65 @@
+// file_io.c: coroutines writing and reading back blocks of one file, over io_uring and the thread pool
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <co.h>
+
+#define N 64
+#define BLOCK (64 * 1024)
+
+static int fd;
+static atomic_int verified = 0;
+
+void worker(void *arg) {
+    int id = (int) (long) arg;
+    char *out = malloc(BLOCK), *in = malloc(BLOCK);
+    memset(out, 'a' + id % 26, BLOCK);
+    assert(co_pwrite(fd, out, BLOCK, (off_t) id * BLOCK) == BLOCK);
+    assert(co_fsync(fd) == 0);
+    assert(co_pread(fd, in, BLOCK, (off_t) id * BLOCK) == BLOCK);
+    if (memcmp(in, out, BLOCK) == 0) atomic_fetch_add(&verified, 1);
+    free(out);
+    free(in);
+}
+
+int run(int disable_io_uring) {
+    struct co_config config = {.disable_io_uring = disable_io_uring};
+    co_init_ex(&config);
+    char path[] = "/tmp/co_file_io_XXXXXX";
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+
+    struct co *cos[N];
+    for (int i = 0; i < N; i++) {
+        cos[i] = co_start("file_io", worker, (void *) (long) i);
+    }
+    for (int i = 0; i < N; i++) {
+        co_wait(cos[i]);
+        co_release(cos[i]);
+    }
+    close(fd);
+
+    printf("%s: verified %d/%d blocks\n", disable_io_uring ? "thread pool" : "io_uring", atomic_load(&verified), N);
+    fflush(stdout);
+    return atomic_load(&verified) == N ? 0 : 1;
+}
+
+int main() {
+    // the thread pool fallback runs in a child with its own runtime, fork before co_init
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(run(1));
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    assert(run(0) == 0);
+    printf("File I/O test passed!\n");
+    return 0;
+}
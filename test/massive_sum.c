@@ -5,6 +5,7 @@
 
 #define N 10000  // 协程数量大幅提升
 #define RANGE 10  // 每协程计算小段区间，强调调度和并发
+#define GRAIN 1000  // co_parallel_reduce 每次调用累加的最多个数
 
 struct task_arg {
     int id;
@@ -24,6 +25,20 @@ void worker(void *arg) {
     targ->result = sum;
 }
 
+// co_parallel_reduce 版本：按需切分区间，部分和按顺序合并
+void sum_squares(long start, long end, void *acc, void *ctx) {
+    (void) ctx;
+    long long sum = 0;
+    for (long i = start; i < end; i++)
+        sum += (long long)i * i;
+    *(long long *)acc += sum;
+}
+
+void add(void *acc, const void *other, void *ctx) {
+    (void) ctx;
+    *(long long *)acc += *(const long long *)other;
+}
+
 int main() {
     co_init();
 
@@ -34,17 +49,31 @@ int main() {
         args[i]->start = i * RANGE + 1;
         args[i]->end = (i + 1) * RANGE;
         args[i]->result = 0;
-
-        cos[i] = co_start("massive", worker, args[i]);
     }
+    uint64_t start = co_now();
+    co_start_batch("massive", worker, (void **) args, N, cos);
 
     long long total = 0;
     for (int i = 0; i < N; i++) {
         co_wait(cos[i]);
+        co_release(cos[i]);
         total += args[i]->result;
         free(args[i]);
     }
+    uint64_t hand_split = co_now() - start;
 
+    long long zero = 0, reduced;
+    start = co_now();
+    co_parallel_reduce(1, (long) N * RANGE + 1, GRAIN, &zero, &reduced, sizeof(long long), sum_squares, add, NULL);
+    uint64_t parallel_reduce = co_now() - start;
+
+    printf("Hand split: %llu us, co_parallel_reduce: %llu us\n",
+           (unsigned long long) hand_split / 1000, (unsigned long long) parallel_reduce / 1000);
+    printf("Reduced sum = %lld\n", reduced);
+    if (reduced != total) {
+        printf("Mismatch!\n");
+        return 1;
+    }
     printf("Total sum = %lld\n", total);
     return 0;
 }
@@ -1,10 +1,12 @@
 // test_matrix_transpose.c
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <co.h>
 
 #define N 16  // 协程数量
 #define SIZE 512  // 矩阵规模
+#define GRAIN 8  // co_parallel_for 每次调用处理的最多行数
 
 int A[SIZE][SIZE];
 int B[SIZE][SIZE];
@@ -26,6 +28,22 @@ void transpose_worker(void *arg) {
     }
 }
 
+// co_parallel_for 版本：按需切分行区间，无需手动分块和 co_yield
+void transpose_rows(long row_start, long row_end, void *ctx) {
+    (void) ctx;
+    for (long i = row_start; i < row_end; i++)
+        for (int j = 0; j < SIZE; j++)
+            B[j][i] = A[i][j];
+}
+
+int check() {
+    for (int i = 0; i < SIZE; i++)
+        for (int j = 0; j < SIZE; j++)
+            if (B[j][i] != A[i][j])
+                return 0;
+    return 1;
+}
+
 int main() {
     co_init();
 
@@ -36,6 +54,7 @@ int main() {
 
     struct task_arg *args[N];
     int rows_per_co = SIZE / N;
+    uint64_t start = co_now();
 
     for (int i = 0; i < N; i++) {
         args[i] = malloc(sizeof(struct task_arg));
@@ -46,18 +65,25 @@ int main() {
 
     for (int i = 0; i < N; i++) {
         co_wait(cos[i]);
+        co_release(cos[i]);
         free(args[i]);
     }
+    uint64_t hand_split = co_now() - start;
 
     printf("Matrix transpose done.\n");
 
     // 可选校验
-    int passed = 1;
-    for (int i = 0; i < SIZE; i++)
-        for (int j = 0; j < SIZE; j++)
-            if (B[j][i] != A[i][j])
-                passed = 0;
+    int passed = check();
+
+    // 同样的转置交给 co_parallel_for
+    memset(B, 0, sizeof(B));
+    start = co_now();
+    co_parallel_for(0, SIZE, GRAIN, transpose_rows, NULL);
+    uint64_t parallel_for = co_now() - start;
+    passed = passed && check();
 
+    printf("Hand split: %llu us, co_parallel_for: %llu us\n",
+           (unsigned long long) hand_split / 1000, (unsigned long long) parallel_for / 1000);
     printf("Transpose %s\n", passed ? "PASSED" : "FAILED");
     return 0;
 }
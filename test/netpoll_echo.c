@@ -0,0 +1,92 @@
+// netpoll_echo.c: an echo server and its clients talking over loopback, all in coroutines
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <co.h>
+
+#define CLIENTS 100
+#define PAYLOAD (32 * 1024)
+
+static struct sockaddr_in server_addr;
+static atomic_int echoed = 0;
+
+void handler(void *arg) {
+    int conn = (int) (long) arg;
+    char buf[4096];
+    ssize_t n;
+    while ((n = co_read(conn, buf, sizeof(buf))) > 0) {
+        assert(co_write(conn, buf, n) == n);
+    }
+    co_close(conn);
+}
+
+void acceptor(void *arg) {
+    int listener = (int) (long) arg;
+    while (1) {
+        int conn = co_accept(listener, NULL, NULL);
+        if (conn < 0) {
+            assert(errno == EBADF); // the listener has been closed
+            return;
+        }
+        co_detach(co_start("handler", handler, (void *) (long) conn));
+    }
+}
+
+void client(void *arg) {
+    int id = (int) (long) arg;
+    char *out = malloc(PAYLOAD), *in = malloc(PAYLOAD);
+    for (int i = 0; i < PAYLOAD; i++) out[i] = (char) (id + i);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    assert(co_connect(fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == 0);
+    assert(co_write(fd, out, PAYLOAD) == PAYLOAD);
+    size_t got = 0;
+    while (got < PAYLOAD) {
+        ssize_t n = co_read(fd, in + got, PAYLOAD - got);
+        assert(n > 0);
+        got += n;
+    }
+    assert(memcmp(in, out, PAYLOAD) == 0);
+    co_close(fd);
+    atomic_fetch_add(&echoed, 1);
+    free(out);
+    free(in);
+}
+
+int main() {
+    co_init();
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    assert(listener >= 0);
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_addr.sin_port = 0;
+    assert(bind(listener, (struct sockaddr *) &server_addr, sizeof(server_addr)) == 0);
+    socklen_t len = sizeof(server_addr);
+    assert(getsockname(listener, (struct sockaddr *) &server_addr, &len) == 0);
+    assert(listen(listener, CLIENTS) == 0);
+
+    struct co *server = co_start("acceptor", acceptor, (void *) (long) listener);
+    struct co *clients[CLIENTS];
+    for (int i = 0; i < CLIENTS; i++) {
+        clients[i] = co_start("client", client, (void *) (long) i);
+    }
+    for (int i = 0; i < CLIENTS; i++) {
+        co_wait(clients[i]);
+        co_release(clients[i]);
+    }
+    co_close(listener);
+    co_wait(server);
+    co_release(server);
+
+    printf("Echoed: %d\n", atomic_load(&echoed));
+    assert(atomic_load(&echoed) == CLIENTS);
+    printf("Netpoll echo test passed!\n");
+    return 0;
+}
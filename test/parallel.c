@@ -0,0 +1,105 @@
+// parallel.c: co_parallel_for and co_parallel_reduce cover every index once and combine in index order
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <co.h>
+
+#define N 1000000
+#define GRAIN 1000
+#define NESTED 8
+#define NESTED_N 10000
+
+static atomic_char *hits;
+
+void mark(long begin, long end, void *ctx) {
+    (void) ctx;
+    assert(end - begin <= GRAIN);
+    for (long i = begin; i < end; i++) {
+        atomic_fetch_add_explicit(&hits[i], 1, memory_order_relaxed);
+    }
+}
+
+// a partial result is the contiguous range it covers, combining anything but the next range fails
+struct span {
+    long lo, hi;
+    long pieces;
+};
+
+void cover(long begin, long end, void *acc, void *ctx) {
+    (void) ctx;
+    struct span *s = acc;
+    if (s->pieces == 0) s->lo = begin;
+    assert(s->pieces == 0 || s->hi == begin);
+    s->hi = end;
+    s->pieces++;
+}
+
+void join(void *acc, const void *other, void *ctx) {
+    (void) ctx;
+    struct span *s = acc;
+    const struct span *o = other;
+    if (o->pieces == 0) return;
+    if (s->pieces == 0) {
+        *s = *o;
+        return;
+    }
+    assert(s->hi == o->lo);
+    s->hi = o->hi;
+    s->pieces += o->pieces;
+}
+
+void add(long begin, long end, void *acc, void *ctx) {
+    (void) ctx;
+    for (long i = begin; i < end; i++) *(long *) acc += i;
+}
+
+void sum(void *acc, const void *other, void *ctx) {
+    (void) ctx;
+    *(long *) acc += *(const long *) other;
+}
+
+// coroutines running parallel loops of their own at the same time, half of them on a shared stack
+void nested(void *arg) {
+    long zero = 0, total = -1;
+    co_parallel_reduce(0, NESTED_N, 10, &zero, &total, sizeof(long), add, sum, NULL);
+    assert(total == (long) NESTED_N * (NESTED_N - 1) / 2);
+    *(long *) arg = total;
+}
+
+int main() {
+    co_init();
+
+    hits = calloc(N, sizeof(atomic_char));
+    uint64_t start = co_now();
+    co_parallel_for(0, N, GRAIN, mark, NULL);
+    printf("co_parallel_for over %d indices: %llu us\n", N, (unsigned long long) (co_now() - start) / 1000);
+    for (long i = 0; i < N; i++) {
+        assert(atomic_load(&hits[i]) == 1);
+    }
+    co_parallel_for(5, 5, GRAIN, mark, NULL); // empty
+    free(hits);
+
+    struct span empty = {0, 0, 0}, span;
+    co_parallel_reduce(-N / 2, N / 2, GRAIN, &empty, &span, sizeof(struct span), cover, join, NULL);
+    printf("Reduced [%ld, %ld) from %ld pieces\n", span.lo, span.hi, span.pieces);
+    assert(span.lo == -N / 2 && span.hi == N / 2);
+    assert(span.pieces >= N / GRAIN);
+    co_parallel_reduce(0, 10, 100, &empty, &span, sizeof(struct span), cover, join, NULL);
+    assert(span.lo == 0 && span.hi == 10 && span.pieces == 1);
+
+    struct co_attr shared = {.shared_stack = 1};
+    struct co *cos[NESTED];
+    long totals[NESTED];
+    for (int i = 0; i < NESTED; i++) {
+        cos[i] = co_start_attr("nested", nested, &totals[i], i % 2 ? &shared : NULL);
+    }
+    co_wait_all(cos, NESTED);
+    for (int i = 0; i < NESTED; i++) {
+        co_release(cos[i]);
+        assert(totals[i] == (long) NESTED_N * (NESTED_N - 1) / 2);
+    }
+
+    printf("Parallel test passed!\n");
+    return 0;
+}
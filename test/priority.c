@@ -0,0 +1,93 @@
+// priority.c: latency of short requests under a flood of yielding batch coroutines, without and with priority classes
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <co.h>
+
+#define FLOOD 2000
+#define BATCHES 100
+#define BATCH 10
+#define REQUESTS (BATCHES * BATCH)
+#define CHUNK_NS 10000ULL // work between two yields of a flood coroutine
+#define MAX_P99_MS 20 // generous, the whole test may share one CPU
+#define MS 1000000ULL
+
+static atomic_int stop = 0;
+static uint64_t latencies[REQUESTS];
+
+static void busy(uint64_t ns) {
+    uint64_t end = co_now() + ns;
+    while (co_now() < end);
+}
+
+void flooder(void *arg) {
+    (void) arg;
+    while (!atomic_load(&stop)) {
+        busy(CHUNK_NS);
+        co_yield();
+    }
+}
+
+struct request {
+    int id;
+    uint64_t started;
+};
+
+void request(void *arg) {
+    struct request *req = arg;
+    busy(CHUNK_NS / 10);
+    latencies[req->id] = co_now() - req->started;
+}
+
+static int cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// p99 latency of the requests, started BATCH at a time every millisecond while the flood keeps every M busy
+static uint64_t run(enum co_priority flood_priority, enum co_priority request_priority) {
+    struct co_attr flood_attr = {.priority = flood_priority}, request_attr = {.priority = request_priority};
+    struct co **flood = malloc(sizeof(struct co *) * FLOOD);
+    struct co **requests = malloc(sizeof(struct co *) * REQUESTS);
+    struct request *reqs = malloc(sizeof(struct request) * REQUESTS);
+    atomic_store(&stop, 0);
+    for (int i = 0; i < FLOOD; i++) {
+        flood[i] = co_start_attr("flooder", flooder, NULL, &flood_attr);
+    }
+    co_sleep(10 * MS);
+    for (int b = 0; b < BATCHES; b++) {
+        for (int i = b * BATCH; i < (b + 1) * BATCH; i++) {
+            reqs[i] = (struct request) {.id = i, .started = co_now()};
+            requests[i] = co_start_attr("request", request, &reqs[i], &request_attr);
+        }
+        co_sleep(MS);
+    }
+    for (int i = 0; i < REQUESTS; i++) {
+        co_wait(requests[i]);
+        co_release(requests[i]);
+    }
+    atomic_store(&stop, 1);
+    for (int i = 0; i < FLOOD; i++) {
+        co_wait(flood[i]);
+        co_release(flood[i]);
+    }
+    qsort(latencies, REQUESTS, sizeof(uint64_t), cmp);
+    free(flood);
+    free(requests);
+    free(reqs);
+    return latencies[REQUESTS * 99 / 100];
+}
+
+int main() {
+    co_init();
+
+    uint64_t flat = run(CO_PRIORITY_NORMAL, CO_PRIORITY_NORMAL);
+    uint64_t classed = run(CO_PRIORITY_BACKGROUND, CO_PRIORITY_CRITICAL);
+    printf("Request p99: %llu us all normal, %llu us critical over background\n",
+           (unsigned long long) flat / 1000, (unsigned long long) classed / 1000);
+    assert(classed < flat);
+    assert(classed < MAX_P99_MS * MS);
+    printf("Priority test passed!\n");
+    return 0;
+}
@@ -88,11 +88,13 @@ int main() {
     // 等待所有生产者完成
     for (int i = 0; i < N_PRODUCER; ++i) {
         co_wait(producers[i]);
+        co_release(producers[i]);
     }
 
     // 等待所有消费者完成
     for (int i = 0; i < N_CONSUMER; ++i) {
         co_wait(consumers[i]);
+        co_release(consumers[i]);
     }
 
     // 清理资源
@@ -31,7 +31,7 @@ long long compute_cube_sum(int start, int count) {
     return sum;
 }
 
-void stress_task(void *arg) {
+union co_value stress_task(void *arg) {
     Task *task = (Task *) arg;
 
     // 执行实际工作 - 计算立方和
@@ -47,9 +47,8 @@ void stress_task(void *arg) {
         }
     }
 
-    // 存储结果
-    task->result = result;
-    task->completed = 1;
+    // 结果由 co_spawn 保存在协程内，co_await_result 取回
+    return (union co_value) {.i = result};
 }
 
 int main(int argc, char *argv[]) {
@@ -102,7 +101,7 @@ int main(int argc, char *argv[]) {
     for (int i = 0; i < num_coroutines; i++) {
         char name[32];
         sprintf(name, "stress-%d", i);
-        coroutines[i] = co_start(name, stress_task, &tasks[i]);
+        coroutines[i] = co_spawn(name, stress_task, &tasks[i]);
     }
 
     // 分批等待协程完成
@@ -115,7 +114,9 @@ int main(int argc, char *argv[]) {
 
         for (int i = start; i < end; i++) {
             if (i < num_coroutines) {
-                co_wait(coroutines[i]);
+                tasks[i].result = co_await_result(coroutines[i]).i;
+                tasks[i].completed = 1;
+                co_release(coroutines[i]);
             }
         }
 
@@ -43,6 +43,8 @@ int main() {
     // 等待两个协程完成
     co_wait(co1);
     co_wait(co2);
+    co_release(co1);
+    co_release(co2);
 
     // 销毁信号量
     co_sem_destroy(sem);
@@ -0,0 +1,60 @@
+// shared_stack.c: many shared-stack coroutines keep their locals across suspensions
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <co.h>
+
+#define N 10000
+#define ROUNDS 5
+#define LOCAL_SIZE 256
+
+static struct co_sem *start_sem;
+static atomic_int done = 0;
+static atomic_int corrupted = 0;
+
+void worker(void *arg) {
+    int id = (int) (long) arg;
+    unsigned char local[LOCAL_SIZE];
+    memset(local, id & 0xff, sizeof(local));
+    // all coroutines are suspended here at once, each holding its frames in a save buffer
+    co_sem_wait(start_sem);
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < LOCAL_SIZE; i++) {
+            if (local[i] != (unsigned char) ((id + round) & 0xff)) {
+                atomic_fetch_add(&corrupted, 1);
+                break;
+            }
+        }
+        memset(local, (id + round + 1) & 0xff, sizeof(local));
+        co_yield();
+    }
+    atomic_fetch_add(&done, 1);
+}
+
+int main() {
+    co_init();
+    start_sem = co_sem_create(0);
+
+    struct co_attr attr = { .shared_stack = 1 };
+    struct co **cos = malloc(sizeof(struct co *) * N);
+    for (int i = 0; i < N; i++) {
+        cos[i] = co_start_attr("shared", worker, (void *) (long) i, &attr);
+    }
+    for (int i = 0; i < N; i++) {
+        co_sem_post(start_sem);
+    }
+    for (int i = 0; i < N; i++) {
+        co_wait(cos[i]);
+        co_release(cos[i]);
+    }
+
+    printf("Done: %d, corrupted: %d\n", atomic_load(&done), atomic_load(&corrupted));
+    assert(atomic_load(&done) == N);
+    assert(atomic_load(&corrupted) == 0);
+    printf("Shared stack test passed!\n");
+    co_sem_destroy(start_sem);
+    free(cos);
+    return 0;
+}
@@ -0,0 +1,62 @@
+// sleep_timers.c: many sleeping coroutines wake up after their deadlines, and not much later
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <co.h>
+
+#define N 10000
+#define MAX_SLEEP_MS 200 // beyond 64 ticks, so timers cascade from the second level of the wheel
+#define MAX_LATE_MS 100 // generous, the whole test may share one CPU
+#define MS 1000000ULL
+
+static atomic_int early = 0;
+static atomic_ullong max_late = 0;
+
+void sleeper(void *arg) {
+    int id = (int) (long) arg;
+    for (int round = 0; round < 3; round++) {
+        uint64_t deadline = co_now() + (uint64_t) ((id + round) % MAX_SLEEP_MS + 1) * MS;
+        co_sleep_until(deadline);
+        uint64_t now = co_now();
+        if (now < deadline) {
+            atomic_fetch_add(&early, 1);
+            continue;
+        }
+        unsigned long long late = now - deadline, seen = atomic_load(&max_late);
+        while (late > seen && !atomic_compare_exchange_weak(&max_late, &seen, late));
+    }
+}
+
+int main() {
+    co_init();
+
+    uint64_t start = co_now();
+    struct co **cos = malloc(sizeof(struct co *) * N);
+    for (int i = 0; i < N; i++) {
+        cos[i] = co_start("sleeper", sleeper, (void *) (long) i);
+    }
+    for (int i = 0; i < N; i++) {
+        co_wait(cos[i]);
+        co_release(cos[i]);
+    }
+    uint64_t elapsed = co_now() - start;
+
+    // main sleeps too, its thread runs other coroutines meanwhile
+    uint64_t deadline = co_now() + 5 * MS;
+    co_sleep_until(deadline);
+    assert(co_now() >= deadline);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long cpu_ms = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000
+                  + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+    printf("Elapsed: %llu ms, CPU: %ld ms, max lateness: %llu ms, early: %d\n",
+           (unsigned long long) (elapsed / MS), cpu_ms, atomic_load(&max_late) / MS, atomic_load(&early));
+    assert(atomic_load(&early) == 0);
+    assert(atomic_load(&max_late) < MAX_LATE_MS * MS);
+    printf("Sleep timers test passed!\n");
+    free(cos);
+    return 0;
+}
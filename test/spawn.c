@@ -0,0 +1,85 @@
+// spawn.c: coroutines returning values through co_spawn and co_await_result
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <co.h>
+
+#define FIB 18
+#define CUTOFF 8
+#define FANOUT 1000
+#define AWAITERS 20
+
+static long fib_serial(long n) {
+    return n < 2 ? n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+// fan out into two coroutines per level and fan in through their results, no argument structs involved
+union co_value fib(void *arg) {
+    long n = (long) arg;
+    if (n < CUTOFF) return (union co_value) {.i = fib_serial(n)};
+    struct co *a = co_spawn("fib", fib, (void *) (n - 1));
+    struct co *b = co_spawn("fib", fib, (void *) (n - 2));
+    int64_t result = co_await_result(a).i + co_await_result(b).i;
+    co_release(a);
+    co_release(b);
+    return (union co_value) {.i = result};
+}
+
+union co_value half(void *arg) {
+    if ((long) arg % 3 == 0) co_yield();
+    return (union co_value) {.d = (double) (long) arg / 2};
+}
+
+static long shared_value = 42;
+
+union co_value pointer(void *arg) {
+    (void) arg;
+    co_sleep(1000000);
+    return (union co_value) {.p = &shared_value};
+}
+
+// several coroutines await the same one
+void awaiter(void *arg) {
+    struct co *target = arg;
+    assert(co_await_result(target).p == &shared_value);
+}
+
+int main() {
+    co_init();
+
+    struct co *root = co_spawn("fib", fib, (void *) FIB);
+    int64_t result = co_await_result(root).i;
+    co_release(root);
+    printf("fib(%d) = %lld\n", FIB, (long long) result);
+    assert(result == fib_serial(FIB));
+
+    // results stay readable after the coroutines have finished, also once joined by co_wait_all
+    struct co **cos = malloc(sizeof(struct co *) * FANOUT);
+    for (long i = 0; i < FANOUT; i++) {
+        cos[i] = co_spawn("half", half, (void *) i);
+    }
+    co_wait_all(cos, FANOUT);
+    double sum = 0;
+    for (long i = 0; i < FANOUT; i++) {
+        assert(co_await_result(cos[i]).d == (double) i / 2);
+        sum += co_await_result(cos[i]).d;
+        co_release(cos[i]);
+    }
+    assert(sum == (double) FANOUT * (FANOUT - 1) / 4);
+    free(cos);
+
+    struct co *target = co_spawn("pointer", pointer, NULL);
+    struct co *awaiters[AWAITERS];
+    for (int i = 0; i < AWAITERS; i++) {
+        awaiters[i] = co_start("awaiter", awaiter, target);
+    }
+    co_wait_all(awaiters, AWAITERS);
+    for (int i = 0; i < AWAITERS; i++) {
+        co_release(awaiters[i]);
+    }
+    assert(*(long *) co_await_result(target).p == 42);
+    co_release(target);
+
+    printf("Spawn test passed!\n");
+    return 0;
+}
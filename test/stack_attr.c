@@ -0,0 +1,70 @@
+// stack_attr.c: per-coroutine stack sizes and the guard page below each stack
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <co.h>
+
+#define N 100
+#define DEEP_STACK_SIZE (1024 * 1024) // 1MB
+#define FRAME_SIZE 1024
+
+struct task_arg {
+    int depth;
+    long result;
+};
+
+// every frame holds FRAME_SIZE bytes, so that depth * FRAME_SIZE bytes of stack are touched
+long recurse(int depth) {
+    volatile char frame[FRAME_SIZE];
+    memset((char *) frame, depth & 0xff, sizeof(frame));
+    if (depth == 0) return 0;
+    return recurse(depth - 1) + frame[depth % FRAME_SIZE];
+}
+
+void worker(void *arg) {
+    struct task_arg *targ = (struct task_arg *) arg;
+    targ->result = recurse(targ->depth);
+    co_yield();
+}
+
+int main() {
+    // overflowing the default 16KB stack must hit the guard page instead of corrupting memory,
+    // fork before co_init so that the child starts its own runtime
+    pid_t pid = fork();
+    if (pid == 0) {
+        co_init();
+        struct task_arg overflow = { .depth = 64, .result = -1 };
+        struct co *co = co_start("overflow", worker, &overflow);
+        co_wait(co);
+        co_release(co);
+        _exit(0);
+    }
+
+    co_init();
+
+    // 100 coroutines each using ~512KB of a 1MB stack
+    struct co_attr attr = { .stack_size = DEEP_STACK_SIZE };
+    struct task_arg args[N];
+    struct co *cos[N];
+    for (int i = 0; i < N; i++) {
+        args[i].depth = 512;
+        args[i].result = -1;
+        cos[i] = co_start_attr("deep", worker, &args[i], &attr);
+    }
+    for (int i = 0; i < N; i++) {
+        co_wait(cos[i]);
+        co_release(cos[i]);
+        assert(args[i].result == recurse(512));
+    }
+    printf("Deep stacks PASSED\n");
+
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+    printf("Guard page PASSED\n");
+    return 0;
+}
@@ -0,0 +1,89 @@
+// start_batch.c: fan-out with co_start_batch, against the same fan-out with a co_start per coroutine
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <co.h>
+
+#define REQUESTS 10
+#define FANOUT 32
+#define ROUNDS 200
+#define BIG 20000 // far more than a running queue holds, the rest spills to the injection queue
+
+static atomic_long ran = 0;
+static atomic_long spawn_ns = 0;
+
+void sub(void *arg) {
+    long *slot = arg;
+    if (slot) *slot += 1;
+    atomic_fetch_add(&ran, 1);
+}
+
+void request(void *arg) {
+    int batch = (int) (long) arg;
+    long slots[FANOUT] = {0};
+    void *args[FANOUT];
+    struct co *cos[FANOUT];
+    for (int i = 0; i < FANOUT; i++) {
+        args[i] = &slots[i];
+    }
+    for (int r = 0; r < ROUNDS; r++) {
+        uint64_t start = co_now();
+        if (batch) {
+            co_start_batch("sub", sub, args, FANOUT, cos);
+        } else {
+            for (int i = 0; i < FANOUT; i++) {
+                cos[i] = co_start("sub", sub, args[i]);
+            }
+        }
+        atomic_fetch_add(&spawn_ns, co_now() - start);
+        co_wait_all(cos, FANOUT);
+        for (int i = 0; i < FANOUT; i++) {
+            co_release(cos[i]);
+        }
+    }
+    for (int i = 0; i < FANOUT; i++) {
+        assert(slots[i] == ROUNDS);
+    }
+}
+
+// average time to spawn a fan-out of FANOUT coroutines
+static uint64_t fan_out(int batch) {
+    struct co *requests[REQUESTS];
+    atomic_store(&spawn_ns, 0);
+    for (int i = 0; i < REQUESTS; i++) {
+        requests[i] = co_start("request", request, (void *) (long) batch);
+    }
+    co_wait_all(requests, REQUESTS);
+    for (int i = 0; i < REQUESTS; i++) {
+        co_release(requests[i]);
+    }
+    return atomic_load(&spawn_ns) / (REQUESTS * ROUNDS);
+}
+
+int main() {
+    co_init();
+
+    uint64_t single = fan_out(0);
+    uint64_t batched = fan_out(1);
+    assert(atomic_load(&ran) == 2L * REQUESTS * ROUNDS * FANOUT);
+    printf("Spawning %d coroutines: %llu ns with co_start, %llu ns with co_start_batch\n", FANOUT,
+           (unsigned long long) single, (unsigned long long) batched);
+
+    // main spawns a batch larger than its running queue, NULL args
+    struct co **cos = malloc(sizeof(struct co *) * BIG);
+    atomic_store(&ran, 0);
+    uint64_t start = co_now();
+    co_start_batch("big", sub, NULL, BIG, cos);
+    printf("Spawned %d coroutines in %llu us\n", BIG, (unsigned long long) (co_now() - start) / 1000);
+    co_wait_all(cos, BIG);
+    for (int i = 0; i < BIG; i++) {
+        co_release(cos[i]);
+    }
+    assert(atomic_load(&ran) == BIG);
+    co_start_batch("none", sub, NULL, 0, cos);
+
+    printf("Start batch test passed!\n");
+    free(cos);
+    return 0;
+}
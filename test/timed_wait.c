@@ -0,0 +1,113 @@
+// timed_wait.c: timed semaphore and coroutine waits time out, and racing posts are neither lost nor doubled
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <co.h>
+
+#define N 1000
+#define ROUNDS 20
+#define MS 1000000ULL
+
+static struct co_sem *never, *racy;
+static atomic_int early = 0;
+static atomic_int taken = 0;
+static atomic_int timed_out = 0;
+
+void idle_waiter(void *arg) {
+    (void) arg;
+    uint64_t deadline = co_now() + 10 * MS;
+    assert(co_sem_timedwait(never, deadline) == -1 && errno == ETIMEDOUT);
+    if (co_now() < deadline) atomic_fetch_add(&early, 1);
+}
+
+// deadlines land right around the posts, so expiry and co_sem_post race for the same waiters
+void racy_waiter(void *arg) {
+    int id = (int) (long) arg;
+    for (int round = 0; round < ROUNDS; round++) {
+        if (co_sem_timedwait(racy, co_now() + (uint64_t) (id % 3) * MS) == 0) {
+            atomic_fetch_add(&taken, 1);
+        } else {
+            atomic_fetch_add(&timed_out, 1);
+        }
+    }
+}
+
+void poster(void *arg) {
+    int posts = (int) (long) arg;
+    for (int i = 0; i < posts; i++) {
+        co_sem_post(racy);
+        if (i % 64 == 0) co_sleep(MS / 2);
+    }
+}
+
+void sleeper(void *arg) {
+    co_sleep((uint64_t) (long) arg * MS);
+}
+
+void joiner(void *arg) {
+    struct co *target = arg;
+    assert(co_wait_timeout(target, co_now() + 5 * MS) == -1 && errno == ETIMEDOUT);
+    assert(co_wait_timeout(target, co_now() + 1000 * MS) == 0);
+}
+
+int main() {
+    co_init();
+    never = co_sem_create(0);
+    racy = co_sem_create(0);
+
+    // nobody posts, every waiter times out
+    struct co **cos = malloc(sizeof(struct co *) * N);
+    for (int i = 0; i < N; i++) {
+        cos[i] = co_start("idle_waiter", idle_waiter, NULL);
+    }
+    for (int i = 0; i < N; i++) {
+        co_wait(cos[i]);
+        co_release(cos[i]);
+    }
+    assert(atomic_load(&early) == 0);
+
+    // every post is either taken by exactly one waiter or still counted by the semaphore
+    int posts = N * ROUNDS / 2;
+    for (int i = 0; i < N; i++) {
+        cos[i] = co_start("racy_waiter", racy_waiter, (void *) (long) i);
+    }
+    struct co *post = co_start("poster", poster, (void *) (long) posts);
+    for (int i = 0; i < N; i++) {
+        co_wait(cos[i]);
+        co_release(cos[i]);
+    }
+    co_wait(post);
+    co_release(post);
+    int left = 0;
+    while (co_sem_timedwait(racy, 0) == 0) left++;
+    printf("Taken: %d, timed out: %d, left: %d\n", atomic_load(&taken), atomic_load(&timed_out), left);
+    assert(atomic_load(&taken) + atomic_load(&timed_out) == N * ROUNDS);
+    assert(atomic_load(&taken) + left == posts);
+
+    // a coroutine waits for another with a deadline
+    struct co *target = co_start("sleeper", sleeper, (void *) 20L);
+    struct co *join = co_start("joiner", joiner, target);
+    co_wait(join);
+    co_release(join);
+
+    // main waits with a deadline too
+    uint64_t deadline = co_now() + 5 * MS;
+    assert(co_sem_timedwait(never, deadline) == -1 && errno == ETIMEDOUT);
+    assert(co_now() >= deadline);
+    co_sem_post(never);
+    assert(co_sem_timedwait(never, co_now() + 5 * MS) == 0);
+    struct co *slow = co_start("sleeper", sleeper, (void *) 50L);
+    assert(co_wait_timeout(slow, co_now() + 5 * MS) == -1 && errno == ETIMEDOUT);
+    assert(co_wait_timeout(slow, co_now() + 1000 * MS) == 0);
+    co_release(slow);
+    co_wait(target);
+    co_release(target);
+
+    printf("Timed wait test passed!\n");
+    co_sem_destroy(never);
+    co_sem_destroy(racy);
+    free(cos);
+    return 0;
+}
@@ -38,6 +38,7 @@ int main() {
 
     for (int i = 0; i < N; i++) {
         co_wait(cos[i]);
+        co_release(cos[i]);
         free(args[i]);
     }
 
@@ -0,0 +1,94 @@
+// wait_all.c: scatter/gather requests joining their sub-coroutines with co_wait_all and co_waitgroup
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <co.h>
+
+#define REQUESTS 200
+#define MIN_FANOUT 50
+#define MAX_FANOUT 200
+#define JOINED 10000
+
+struct part {
+    int id;
+    long result;
+    struct co_waitgroup *wg;
+};
+
+static atomic_long total = 0;
+
+void sub(void *arg) {
+    struct part *part = arg;
+    if (part->id % 7 == 0) co_yield();
+    part->result = part->id;
+    if (part->wg) co_waitgroup_done(part->wg);
+}
+
+// every other request joins with co_wait_all, the rest with a wait group
+void request(void *arg) {
+    int id = (int) (long) arg;
+    int fanout = MIN_FANOUT + id % (MAX_FANOUT - MIN_FANOUT + 1);
+    struct part *parts = malloc(sizeof(struct part) * fanout);
+    struct co **cos = malloc(sizeof(struct co *) * fanout);
+    struct co_waitgroup *wg = id % 2 ? co_waitgroup_create() : NULL;
+    if (wg) co_waitgroup_add(wg, fanout);
+    for (int i = 0; i < fanout; i++) {
+        parts[i] = (struct part) {.id = i, .wg = wg};
+        cos[i] = co_start("sub", sub, &parts[i]);
+    }
+    if (wg) {
+        co_waitgroup_wait(wg);
+        co_waitgroup_destroy(wg);
+    } else {
+        co_wait_all(cos, fanout);
+    }
+    long sum = 0;
+    for (int i = 0; i < fanout; i++) {
+        sum += parts[i].result;
+        co_release(cos[i]);
+    }
+    assert(sum == (long) fanout * (fanout - 1) / 2);
+    atomic_fetch_add(&total, sum);
+    free(parts);
+    free(cos);
+}
+
+void noop(void *arg) {
+    (void) arg;
+}
+
+int main() {
+    co_init();
+
+    struct co *requests[REQUESTS];
+    long expected = 0;
+    for (int i = 0; i < REQUESTS; i++) {
+        int fanout = MIN_FANOUT + i % (MAX_FANOUT - MIN_FANOUT + 1);
+        expected += (long) fanout * (fanout - 1) / 2;
+        requests[i] = co_start("request", request, (void *) (long) i);
+    }
+    co_wait_all(requests, REQUESTS);
+    for (int i = 0; i < REQUESTS; i++) {
+        co_release(requests[i]);
+    }
+    printf("Total: %ld\n", atomic_load(&total));
+    assert(atomic_load(&total) == expected);
+
+    // main joins many coroutines, some of them finished already
+    struct co **cos = malloc(sizeof(struct co *) * JOINED);
+    for (int i = 0; i < JOINED; i++) {
+        cos[i] = co_start("noop", noop, NULL);
+    }
+    uint64_t start = co_now();
+    co_wait_all(cos, JOINED);
+    printf("Joined %d coroutines in %llu us\n", JOINED, (unsigned long long) (co_now() - start) / 1000);
+    for (int i = 0; i < JOINED; i++) {
+        co_release(cos[i]);
+    }
+    co_wait_all(cos, 0);
+
+    printf("Wait all test passed!\n");
+    free(cos);
+    return 0;
+}
@@ -0,0 +1,49 @@
+// yield_bench.c: latency of a co_yield round trip (coroutine -> scheduler -> coroutine)
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <co.h>
+
+#define DEFAULT_NUM_COROUTINES 2
+#define DEFAULT_NUM_YIELDS 1000000
+
+static int num_yields = DEFAULT_NUM_YIELDS;
+
+void yielder(void *arg) {
+    for (int i = 0; i < num_yields; i++) {
+        co_yield();
+    }
+}
+
+int main(int argc, char *argv[]) {
+    // main's M and one more, each running a yielder, so every yield is a pure switch into the scheduler and out again
+    struct co_config config = { .m_num = 2 };
+    co_init_ex(&config);
+
+    int num_coroutines = DEFAULT_NUM_COROUTINES;
+    if (argc > 1) num_coroutines = atoi(argv[1]);
+    if (argc > 2) num_yields = atoi(argv[2]);
+    if (num_coroutines <= 0) num_coroutines = DEFAULT_NUM_COROUTINES;
+    if (num_yields <= 0) num_yields = DEFAULT_NUM_YIELDS;
+
+    struct co **cos = malloc(sizeof(struct co *) * num_coroutines);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_coroutines; i++) {
+        cos[i] = co_start("yielder", yielder, NULL);
+    }
+    for (int i = 0; i < num_coroutines; i++) {
+        co_wait(cos[i]);
+        co_release(cos[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    long long total = (long long) num_coroutines * num_yields;
+    printf("%d coroutines x %d yields\n", num_coroutines, num_yields);
+    printf("Yield round trip: %.1f ns\n", ns / total);
+
+    free(cos);
+    return 0;
+}